@@ -0,0 +1,113 @@
+#!/usr/bin/env python3
+"""Generează un roi sintetic: fișierele in<rank>.txt pentru tema2.
+
+Fiecare fișier are cel puțin un seed (o fracțiune din clienți îl dețin
+complet). Fiecare client își alege lista de dorințe din fișierele pe care nu
+le deține, cu probabilitate proporțională cu popularitatea Zipf a fișierului.
+Pentru fiecare fișier se scrie și rezultatul așteptat, ref_<nume>.
+
+Cu --payload <octeți>, conținutul fișierelor este generat efectiv în
+directorul de ieșire, iar hash-urile sunt MD5 reale ale segmentelor, astfel
+încât rularea poate folosi depozitul de segmente (TEMA2_PIECE_DIR).
+"""
+
+import argparse
+import hashlib
+import os
+import random
+
+
+def zipf_weights(n, skew):
+    return [1.0 / (i + 1) ** skew for i in range(n)]
+
+
+def weighted_sample(rng, items, weights, k):
+    """k elemente distincte, alese proporțional cu ponderile."""
+    items, weights = list(items), list(weights)
+    chosen = []
+    while items and len(chosen) < k:
+        pick = rng.choices(range(len(items)), weights)[0]
+        chosen.append(items.pop(pick))
+        weights.pop(pick)
+    return chosen
+
+
+def segment_hashes(rng, name, n_segments, payload, out_dir):
+    if not payload:
+        return [hashlib.md5(f"{name}:{seg}".encode()).hexdigest() for seg in range(n_segments)]
+
+    data = rng.randbytes(n_segments * payload)
+    with open(os.path.join(out_dir, name), "wb") as f:
+        f.write(data)
+    return [hashlib.md5(data[seg * payload:(seg + 1) * payload]).hexdigest()
+            for seg in range(n_segments)]
+
+
+def generate(out_dir, clients, files, segments, seed_fraction=0.25, overlap=0.5, skew=1.0,
+             trackers=1, payload=0, seed=1):
+    """Scrie manifestele și întoarce descrierea roiului."""
+    if files < 1 or clients < 1 or segments < 1:
+        raise ValueError("clients, files and segments must be positive")
+
+    rng = random.Random(seed)
+    os.makedirs(out_dir, exist_ok=True)
+    names = [f"file{i + 1}" for i in range(files)]
+    client_ranks = list(range(trackers, trackers + clients))
+
+    # Seed-urile fiecărui fișier
+    owned = {rank: [] for rank in client_ranks}
+    n_seeds = max(1, min(clients, round(seed_fraction * clients)))
+    for name in names:
+        for rank in rng.sample(client_ranks, n_seeds):
+            owned[rank].append(name)
+
+    # Dorințele, după popularitatea Zipf (file1 este cel mai popular)
+    popularity = dict(zip(names, zipf_weights(files, skew)))
+    wishes = {}
+    for rank in client_ranks:
+        candidates = [name for name in names if name not in owned[rank]]
+        k = round(overlap * len(candidates))
+        wishes[rank] = weighted_sample(rng, candidates, [popularity[n] for n in candidates], k)
+
+    hashes = {name: segment_hashes(rng, name, segments, payload, out_dir) for name in names}
+    for name, digests in hashes.items():
+        with open(os.path.join(out_dir, f"ref_{name}"), "w") as f:
+            f.write("\n".join(digests) + "\n")
+
+    for rank in client_ranks:
+        lines = [str(len(owned[rank]))]
+        for name in owned[rank]:
+            lines.append(f"{name} {segments}")
+            lines.extend(hashes[name])
+        lines.append(str(len(wishes[rank])))
+        lines.extend(wishes[rank])
+        with open(os.path.join(out_dir, f"in{rank}.txt"), "w") as f:
+            f.write("\n".join(lines) + "\n")
+
+    return {"np": trackers + clients, "wishes": wishes}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("out_dir")
+    parser.add_argument("--clients", type=int, default=8)
+    parser.add_argument("--trackers", type=int, default=1)
+    parser.add_argument("--files", type=int, default=8)
+    parser.add_argument("--segments", type=int, default=100)
+    parser.add_argument("--seed-fraction", type=float, default=0.25,
+                        help="fracțiunea de clienți care dețin complet fiecare fișier")
+    parser.add_argument("--overlap", type=float, default=0.5,
+                        help="fracțiunea din fișierele nedeținute dorite de fiecare client")
+    parser.add_argument("--skew", type=float, default=1.0, help="exponentul Zipf al popularității")
+    parser.add_argument("--payload", type=int, default=0,
+                        help="dimensiunea unui segment; 0 = doar hash-uri")
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    swarm = generate(args.out_dir, args.clients, args.files, args.segments, args.seed_fraction,
+                     args.overlap, args.skew, args.trackers, args.payload, args.seed)
+    print(f"mpirun --oversubscribe -np {swarm['np']} ./tema2")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,60 @@
+#!/usr/bin/env python3
+"""Unește trace-urile scrise de tema2 cu TEMA2_TRACE=<prefix> într-unul singur.
+
+Fiecare rank scrie <prefix>.<rank>.json; rezultatul conține evenimentele
+tuturor rank-urilor (pid = rank), cu timpii deplasați astfel încât primul
+eveniment începe la 0. Se deschide în chrome://tracing sau ui.perfetto.dev.
+
+Exemplu:
+    TEMA2_TRACE=/tmp/run mpirun -np 6 ./tema2
+    bench/merge_traces.py /tmp/run -o /tmp/run.json
+"""
+
+import argparse
+import glob
+import json
+import re
+import sys
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("prefix", help="valoarea lui TEMA2_TRACE din rulare")
+    parser.add_argument("-o", "--output", default=None, help="implicit <prefix>.json")
+    args = parser.parse_args()
+
+    pattern = re.compile(re.escape(args.prefix) + r"\.(\d+)\.json$")
+    paths = sorted((p for p in glob.glob(args.prefix + ".*.json") if pattern.search(p)),
+                   key=lambda p: int(pattern.search(p).group(1)))
+    if not paths:
+        print(f"no traces matching {args.prefix}.<rank>.json", file=sys.stderr)
+        return 1
+
+    events, dropped = [], {}
+    for path in paths:
+        with open(path) as f:
+            trace = json.load(f)
+        events.extend(trace["traceEvents"])
+        other = trace.get("otherData", {})
+        if other.get("dropped"):
+            dropped[other["rank"]] = other["dropped"]
+
+    origin = min((e["ts"] for e in events if "ts" in e), default=0)
+    for event in events:
+        if "ts" in event:
+            event["ts"] = round(event["ts"] - origin, 3)
+
+    output = args.output or args.prefix + ".json"
+    with open(output, "w") as f:
+        json.dump({"traceEvents": events, "displayTimeUnit": "ms",
+                   "otherData": {"ranks": len(paths), "dropped": dropped}}, f)
+    spans = sum(1 for e in events if e.get("ph") == "X")
+    print(f"{output}: {len(paths)} ranks, {spans} spans")
+    if dropped:
+        print(f"ring buffers overflowed on ranks {sorted(dropped)}; oldest spans were dropped")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
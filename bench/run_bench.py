@@ -0,0 +1,190 @@
+#!/usr/bin/env python3
+"""Rulează tema2 pe o grilă de roiuri sintetice și raportează scalarea.
+
+Pentru fiecare combinație de parametri se generează roiul (gen_swarm.py), se
+rulează binarul cu TEMA2_METRICS și se înregistrează: timpul total, timpul
+până la primul segment, dispersia momentelor de terminare între clienți și
+numărul de mesaje. Rezultatele pot fi salvate ca bază de comparație și
+comparate ulterior cu ea.
+
+Exemplu:
+    bench/run_bench.py --clients 4,8,16 --segments 100,1000 --save results.json
+    bench/run_bench.py --baseline bench/baseline.json
+"""
+
+import argparse
+import itertools
+import json
+import os
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from gen_swarm import generate  # noqa: E402
+
+SWEEP_PARAMS = ["clients", "trackers", "files", "segments", "seed_fraction", "overlap", "skew"]
+DEFAULTS = {"clients": "4,8,16", "trackers": "1", "files": "8", "segments": "200",
+            "seed_fraction": "0.25", "overlap": "0.5", "skew": "1.0"}
+METRICS = ["wall_s", "first_segment_s", "completion_spread_s", "messages"]
+
+
+def parse_values(text, kind):
+    return [kind(value) for value in text.split(",") if value]
+
+
+def config_key(config):
+    return ",".join(f"{name}={config[name]}" for name in SWEEP_PARAMS)
+
+
+def check_outputs(run_dir, wishes):
+    """Numărul de fișiere descărcate greșit sau lipsă."""
+    bad = 0
+    for rank, names in wishes.items():
+        for name in names:
+            result = os.path.join(run_dir, f"client{rank}_{name}")
+            expected = os.path.join(run_dir, f"ref_{name}")
+            try:
+                with open(result) as a, open(expected) as b:
+                    bad += a.read().split() != b.read().split()
+            except OSError:
+                bad += 1
+    return bad
+
+
+def run_once(binary, config, mpirun, env_extra, timeout, keep):
+    run_dir = tempfile.mkdtemp(prefix="tema2-bench-")
+    try:
+        swarm = generate(run_dir, config["clients"], config["files"], config["segments"],
+                         config["seed_fraction"], config["overlap"], config["skew"],
+                         config["trackers"], seed=config["seed"])
+        metrics_path = os.path.join(run_dir, "metrics.json")
+        env = dict(os.environ, TEMA2_METRICS=metrics_path, TEMA2_TRACKERS=str(config["trackers"]),
+                   **env_extra)
+        command = mpirun + ["-np", str(swarm["np"]), os.path.abspath(binary)]
+
+        started = time.monotonic()
+        proc = subprocess.run(command, cwd=run_dir, env=env, stdout=subprocess.DEVNULL,
+                              stderr=subprocess.PIPE, timeout=timeout)
+        wall = time.monotonic() - started
+        if proc.returncode != 0:
+            raise RuntimeError(f"{config_key(config)}: exit {proc.returncode}\n"
+                               + proc.stderr.decode(errors="replace")[-2000:])
+
+        with open(metrics_path) as f:
+            report = json.load(f)
+        clients = [r for r in report["ranks"] if r["role"] == "client"]
+        first = [r["first_segment_s"] for r in clients if r["first_segment_s"] > 0]
+        completed = [r["completed_s"] for r in clients]
+        return {
+            "wall_s": wall,
+            "first_segment_s": statistics.median(first) if first else 0.0,
+            "completion_spread_s": max(completed) - min(completed),
+            "messages": sum(m["sent"] for m in report["total"]["messages"].values()),
+            "messages_by_type": {name: m["sent"] for name, m in report["total"]["messages"].items()},
+            "bad_outputs": check_outputs(run_dir, swarm["wishes"]),
+        }
+    finally:
+        if keep:
+            print(f"  kept {run_dir}", file=sys.stderr)
+        else:
+            shutil.rmtree(run_dir, ignore_errors=True)
+
+
+def run_config(args, config, env_extra):
+    """Mediana metricilor peste repetări."""
+    runs = [run_once(args.binary, dict(config, seed=args.seed + i), args.mpirun.split(), env_extra,
+                     args.timeout, args.keep) for i in range(args.repeats)]
+    result = {"config": config}
+    for metric in METRICS:
+        result[metric] = statistics.median(run[metric] for run in runs)
+    result["messages_by_type"] = runs[0]["messages_by_type"]
+    result["bad_outputs"] = sum(run["bad_outputs"] for run in runs)
+    return result
+
+
+def print_curves(results):
+    """Un tabel per parametru variat: metricile în funcție de valoarea lui."""
+    swept = [p for p in SWEEP_PARAMS if len({r["config"][p] for r in results}) > 1]
+    for param in swept or SWEEP_PARAMS[:1]:
+        print(f"\n{param:>14} " + " ".join(f"{m:>20}" for m in METRICS))
+        for value in sorted({r["config"][param] for r in results}):
+            group = [r for r in results if r["config"][param] == value]
+            cells = [statistics.mean(r[m] for r in group) for m in METRICS]
+            print(f"{value:>14} " + " ".join(f"{c:>20.4f}" for c in cells))
+
+
+def compare(results, baseline, tolerance):
+    """Raportul față de bază pentru fiecare configurație comună; întoarce regresiile."""
+    previous = {config_key(r["config"]): r for r in baseline["results"]}
+    regressions = 0
+    print(f"\n{'config':<70} " + " ".join(f"{m:>20}" for m in METRICS))
+    for result in results:
+        old = previous.get(config_key(result["config"]))
+        if not old:
+            continue
+        cells = []
+        for metric in METRICS:
+            ratio = result[metric] / old[metric] if old[metric] else 1.0
+            flag = "!" if ratio > 1 + tolerance else " "
+            if metric in ("wall_s", "messages") and flag == "!":
+                regressions += 1
+            cells.append(f"{ratio:>19.2f}{flag}")
+        print(f"{config_key(result['config']):<70} " + " ".join(cells))
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    for param in SWEEP_PARAMS:
+        parser.add_argument("--" + param.replace("_", "-"), dest=param, default=DEFAULTS[param],
+                            help=f"listă de valori separate prin virgulă (implicit {DEFAULTS[param]})")
+    parser.add_argument("--binary", default=os.path.join(os.path.dirname(__file__), "..", "src", "tema2"))
+    parser.add_argument("--mpirun", default="mpirun --oversubscribe")
+    parser.add_argument("--env", action="append", default=[], metavar="NAME=VALUE",
+                        help="variabilă de mediu suplimentară pentru toate rulările")
+    parser.add_argument("--repeats", type=int, default=3)
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--timeout", type=float, default=120)
+    parser.add_argument("--keep", action="store_true", help="păstrează directoarele rulărilor")
+    parser.add_argument("--save", metavar="FILE", help="scrie rezultatele (format de bază)")
+    parser.add_argument("--baseline", metavar="FILE", help="compară cu rezultatele salvate")
+    parser.add_argument("--tolerance", type=float, default=0.25,
+                        help="creșterea relativă peste care o metrică este semnalată")
+    args = parser.parse_args()
+
+    env_extra = dict(item.split("=", 1) for item in args.env)
+    grid = [parse_values(getattr(args, p), float if p in ("seed_fraction", "overlap", "skew") else int)
+            for p in SWEEP_PARAMS]
+
+    results = []
+    for values in itertools.product(*grid):
+        config = dict(zip(SWEEP_PARAMS, values))
+        print(f"running {config_key(config)}", file=sys.stderr)
+        results.append(run_config(args, config, env_extra))
+
+    print_curves(results)
+    failed = sum(r["bad_outputs"] for r in results)
+    if failed:
+        print(f"\n{failed} downloaded files differ from the expected hashes", file=sys.stderr)
+
+    if args.save:
+        with open(args.save, "w") as f:
+            json.dump({"env": env_extra, "repeats": args.repeats, "results": results}, f, indent=1)
+            f.write("\n")
+
+    regressions = 0
+    if args.baseline:
+        with open(args.baseline) as f:
+            regressions = compare(results, json.load(f), args.tolerance)
+        print(f"\n{regressions} regressions over {args.tolerance:.0%}")
+
+    return 1 if failed or regressions else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -1,16 +1,150 @@
+#define _GNU_SOURCE
 #include <mpi.h>
 #include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-#define TRACKER_RANK 0
-#define MAX_FILES 10
 #define MAX_FILENAME 15
 #define HASH_SIZE 32
-#define MAX_CHUNKS 100
-#define MAX_NUMTASKS 100 
+#define DIGEST_SIZE 16
+#define BITMAP_WORDS(n) (((n) + 63) / 64)
+
+// Câte segmente noi se strâng înainte de o actualizare către tracker
+// (1 = fiecare segment este anunțat imediat)
+#ifndef UPDATE_BATCH
+#define UPDATE_BATCH 1
+#endif
+
+// Cu schimbul de HAVE între peers, tracker-ul e folosit doar pentru
+// descoperire, deci actualizările către el pot fi grupate mai mult
+#ifndef GOSSIP_UPDATE_BATCH
+#define GOSSIP_UPDATE_BATCH 16
+#endif
+
+// La câte segmente descărcate se recalculează ordinea rarest-first, dacă
+// harta locală de disponibilitate s-a schimbat între timp
+#ifndef ORDER_REFRESH
+#define ORDER_REFRESH 10
+#endif
+
+// Reordonarea costă O(n log n) în segmentele rămase, deci pentru fișiere mari
+// se face abia după ce s-a descărcat 1/ORDER_REFRESH_SHARE din ele
+#ifndef ORDER_REFRESH_SHARE
+#define ORDER_REFRESH_SHARE 16
+#endif
+
+// Dimensiunea unui segment în depozitul de segmente (TEMA2_PIECE_DIR)
+#ifndef SEGMENT_SIZE
+#define SEGMENT_SIZE 65536
+#endif
+
+// Manifestul unui fișier real: segmente citite odată și hash-uite de un worker
+#ifndef HASH_BATCH
+#define HASH_BATCH 16
+#endif
+
+// Fereastra de cereri de segmente: câte cereri pot fi în curs în total și
+// către un singur peer, câte segmente grupează o cerere și de câte ori se
+// reîncearcă un segment refuzat
+#ifndef DOWNLOAD_WINDOW
+#define DOWNLOAD_WINDOW 8
+#endif
+
+#ifndef PEER_WINDOW
+#define PEER_WINDOW 2
+#endif
+
+#ifndef REQUEST_BATCH
+#define REQUEST_BATCH 4
+#endif
+
+#define MAX_REQUEST_ATTEMPTS 3
+
+// Endgame: sub ENDGAME_THRESHOLD segmente lipsă (TEMA2_ENDGAME), fiecare
+// segment rămas este cerut de la până la ENDGAME_PEERS deținători deodată
+#ifndef ENDGAME_THRESHOLD
+#define ENDGAME_THRESHOLD 8
+#endif
+
+#ifndef ENDGAME_PEERS
+#define ENDGAME_PEERS 2
+#endif
+
+// Câte fișiere din wish list se descarcă simultan
+#ifndef PARALLEL_FILES
+#define PARALLEL_FILES 2
+#endif
+
+// Ponderea ultimei măsurători în media exponențială a timpilor de răspuns
+#define LATENCY_EWMA_ALPHA 0.2
+
+// Serviciul de upload: câte recepții sunt postate permanent, capacitatea
+// cozii de cereri (putere a lui 2) și numărul implicit de workeri
+#ifndef UPLOAD_RECEIVES
+#define UPLOAD_RECEIVES 4
+#endif
+
+#ifndef UPLOAD_QUEUE
+#define UPLOAD_QUEUE 64
+#endif
+
+#ifndef UPLOAD_WORKERS
+#define UPLOAD_WORKERS 2
+#endif
+
+// Câte rank-uri (0..TRACKER_SHARDS-1) sunt trackere; valoarea implicită
+// pentru TEMA2_TRACKERS
+#ifndef TRACKER_SHARDS
+#define TRACKER_SHARDS 1
+#endif
+
+// Câte recepții ține postate permanent bucla de evenimente a tracker-ului
+#ifndef TRACKER_RECEIVES
+#define TRACKER_RECEIVES 8
+#endif
+
+// Câte thread-uri worker procesează mesajele tracker-ului (0 = bucla de
+// evenimente le procesează singură) și câte actualizări ale aceluiași fișier
+// aplică un worker înainte să treacă la alt fișier
+#ifndef TRACKER_THREADS
+#define TRACKER_THREADS 0
+#endif
+
+#define TRACKER_DRAIN_BATCH 16
+
+// În câte liste (fiecare cu lock-ul ei) își țin trackerele trimiterile în
+// curs, după destinatar; workerii care răspund unor clienți diferiți nu se
+// mai așteaptă unul pe altul
+#ifndef TRACKER_SEND_SHARDS
+#define TRACKER_SEND_SHARDS 8
+#endif
+
+// Tag-uri MPI: 0 pentru datele schimbate cu tracker-ul, 1 pentru semnale și
+// cereri, TAG_AVAILABILITY pentru schimbările de disponibilitate trimise de
+// tracker abonaților, TAG_GOSSIP pentru BITFIELD/HAVE schimbate direct între
+// peers; răspunsul la o cerere de segmente vine pe TAG_PEER_REPLY + slotul
+// cererii, ca răspunsurile servite în paralel să nu se poată încurca, iar
+// conținutul fiecărui segment pe propriul tag, ca recepția lui să poată fi
+// anulată separat
+#define TAG_AVAILABILITY 3
+#define TAG_GOSSIP 4
+#define TAG_PEER_REPLY 16
+#define TAG_PEER_PAYLOAD (TAG_PEER_REPLY + DOWNLOAD_WINDOW)
+
+static inline int payload_tag(int reply_tag, int k) {
+    return TAG_PEER_PAYLOAD + (reply_tag - TAG_PEER_REPLY) * REQUEST_BATCH + k;
+}
 
 typedef enum {
     MSG_ACK = 1,         // Confirmare (Acknowledgement)
@@ -19,898 +153,4729 @@ typedef enum {
     MSG_END_OF_MESSAGE = 4,  // Sfârșit de mesaj (End of Message)
     MSG_UPDATE = 5,          // Actualizare (Update)
     MSG_FINISH = 6,          // Finalizare (Finish)
-    MSG_TERMINATE = 7       // Sfârșit (Terminate)
+    MSG_TERMINATE = 7,      // Sfârșit (Terminate)
+    MSG_CANCEL = 8,         // Renunțare la un fișier (Cancel)
+    MSG_BITFIELD = 9,       // Toate segmentele deținute dintr-un fișier (Bitfield)
+    MSG_HAVE = 10           // Segmente noi într-un fișier (Have)
 } MessageType;
 
+// Hash-ul unui segment în formă binară; textul hex (HASH_SIZE caractere)
+// apare doar la citirea fișierelor de intrare și la scrierea celor de ieșire
+typedef struct {
+    uint8_t bytes[DIGEST_SIZE];
+} segment_digest;
+
 typedef struct  {
     int file_number;                           // ID-ul fișierului
+    char name[MAX_FILENAME];           // Numele din fișierul de intrare
     int n_segments;                    // Numărul de segmente
-    char (*segments)[HASH_SIZE + 1];   // Hash-ul fiecărui segment
-    int usage_count;                  // Numărul de utilizări pentru fiecare segment
+    segment_digest* segments;          // Hash-ul fiecărui segment
+    uint64_t* present;                 // Segmentele deținute
+    uint64_t* advertised;              // Segmentele deja anunțate tracker-ului
+    int update_seq;                    // Ultimul număr de secvență trimis
 } file_info;
 
+// Formatul împachetat al listei de peers trimise de tracker, într-un singur
+// buffer contiguu: antetul, n_peers bitset-uri de BITMAP_WORDS(n_segments)
+// cuvinte, rank-urile celor n_peers peers, numărul de replici al fiecărui
+// segment și tabela de n_segments hash-uri
+typedef struct {
+    int n_segments;                    // Numărul de segmente ale fișierului
+    int n_peers;                       // Numărul de peers care dețin segmente
+} PeerListHeader;
+
+static inline int peer_list_size(int n_segments, int n_peers) {
+    return sizeof(PeerListHeader) + n_peers * BITMAP_WORDS(n_segments) * sizeof(uint64_t) +
+           n_peers * sizeof(int) + n_segments * sizeof(int) + n_segments * sizeof(segment_digest);
+}
+
+// Semnalul de start trimis de tracker, urmat de n_files nume de câte
+// MAX_FILENAME caractere; ID-ul unui fișier este poziția numelui în listă
+typedef struct {
+    int signal;                        // MSG_ACK
+    int n_files;
+} StartHeader;
+
+// Mesajele clienților către tracker sunt de sine stătătoare, pe tag-ul 1,
+// și încep cu semnalul. Înregistrarea este un singur mesaj pe tag-ul 0:
+// numărul de fișiere, apoi pentru fiecare un RegisteredFile și hash-urile lui.
+typedef struct {
+    char name[MAX_FILENAME];
+    int n_segments;
+} RegisteredFile;
+
+// MSG_REQUEST (răspunsul este lista de peers), MSG_FINISH și MSG_CANCEL
+typedef struct {
+    int signal;
+    int file_id;
+} TrackerRequest;
+
+// Actualizare trimisă de client: doar segmentele obținute de la ultima
+// actualizare, urmate de n_segments indici de segment
+typedef struct {
+    int signal;                        // MSG_UPDATE
+    int file_id;
+    int seq;                           // Numărul de secvență per fișier, crescător
+    int n_segments;
+} UpdateHeader;
 
+// Schimbare de disponibilitate trimisă de tracker clienților abonați la
+// fișier: rank-ul deține acum cele n_segments segmente care urmează. Cererea
+// listei de peers abonează clientul; după MSG_FINISH sau MSG_CANCEL tracker-ul
+// îl dezabonează și trimite un mesaj cu n_segments = AVAILABILITY_END, ultimul
+// pentru fișier.
 typedef struct {
+    int file_id;
     int rank;
-    int number_of_files;
-    int number_of_tasks;
-} Peer_args;
+    int n_segments;
+} AvailabilityHeader;
 
-file_info* users_files;
-file_info* wish_list;
+#define AVAILABILITY_END -1
 
+// Câte segmente intră cel mult într-o actualizare; una mai mare se trimite
+// în mai multe mesaje, fiecare cu propriul număr de secvență
+#ifndef UPDATE_MAX_SEGMENTS
+#define UPDATE_MAX_SEGMENTS 1024
+#endif
 
+#define TRACKER_MESSAGE_SIZE (sizeof(UpdateHeader) + UPDATE_MAX_SEGMENTS * sizeof(int))
 
-typedef struct TrackerData {
-    file_info** all_files;
-    int** swarms;
-    int** seeds;
-    int number_of_tasks;
-    int n_clients;
-} TrackerData;
+// Operații pe bitset-uri de segmente
+static inline int bitmap_test(const uint64_t* bits, int i) {
+    return (bits[i >> 6] >> (i & 63)) & 1;
+}
 
-// Inițializare structuri tracker
-TrackerData* init_tracker(int number_of_tasks) {
-    TrackerData* data = calloc(1, sizeof(TrackerData));
-    if (!data) {
-        return NULL;
-    }
-    data->number_of_tasks = number_of_tasks;
-    data->n_clients = number_of_tasks - 1;
+static inline void bitmap_set(uint64_t* bits, int i) {
+    bits[i >> 6] |= 1ULL << (i & 63);
+}
 
-    // Alocare swarms
-    data->swarms = calloc(MAX_FILES + 1, sizeof(int*));
-    if (!data->swarms) goto cleanup_data;
-    
-    for (int i = 0; i < MAX_FILES + 1; i++) {
-        data->swarms[i] = calloc(number_of_tasks, sizeof(int));
-        if (!data->swarms[i]) goto cleanup_swarms;
+static inline void bitmap_fill(uint64_t* bits, int n) {
+    memset(bits, 0xff, (n >> 6) * sizeof(uint64_t));
+    if (n & 63) {
+        bits[n >> 6] = (1ULL << (n & 63)) - 1;
     }
+}
 
-    // Alocare seeds
-    data->seeds = calloc(MAX_FILES + 1, sizeof(int*));
-    if (!data->seeds) goto cleanup_swarms;
-    
-    for (int i = 0; i < MAX_FILES + 1; i++) {
-        data->seeds[i] = calloc(number_of_tasks, sizeof(int));
-        if (!data->seeds[i]) goto cleanup_seeds;
+static inline int bitmap_empty(const uint64_t* bits, int words) {
+    for (int i = 0; i < words; i++) {
+        if (bits[i]) return 0;
     }
+    return 1;
+}
+
+// Comparație pe lățime fixă, fără ramificații pe conținut
+static inline int digest_equal(const segment_digest* a, const segment_digest* b) {
+    uint64_t a0, a1, b0, b1;
+    memcpy(&a0, a->bytes, 8);
+    memcpy(&a1, a->bytes + 8, 8);
+    memcpy(&b0, b->bytes, 8);
+    memcpy(&b1, b->bytes + 8, 8);
+    return ((a0 ^ b0) | (a1 ^ b1)) == 0;
+}
 
-    // Alocare all_files
-    data->all_files = calloc(number_of_tasks, sizeof(file_info*));
-    if (!data->all_files) goto cleanup_seeds;
-    
-    for (int i = 0; i < number_of_tasks; i++) {
-        data->all_files[i] = calloc(MAX_FILES + 1, sizeof(file_info));
-        if (!data->all_files[i]) goto cleanup_files;
+static inline int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
 
-        for (int j = 0; j < MAX_FILES + 1; j++) {
-            data->all_files[i][j].segments = calloc(MAX_CHUNKS, sizeof(char[HASH_SIZE + 1]));
-            if (!data->all_files[i][j].segments) goto cleanup_segments;
+// Conversie din text hex; întoarce -1 dacă textul nu are exact HASH_SIZE cifre hex
+static int parse_digest(const char* hex, segment_digest* digest) {
+    for (int i = 0; i < DIGEST_SIZE; i++) {
+        int high = hex_value(hex[2 * i]);
+        int low = high < 0 ? -1 : hex_value(hex[2 * i + 1]);
+        if (low < 0) {
+            return -1;
         }
+        digest->bytes[i] = (uint8_t)(high << 4 | low);
     }
+    return hex[HASH_SIZE] == '\0' ? 0 : -1;
+}
 
-    return data;
+static void format_digest(const segment_digest* digest, char hex[HASH_SIZE + 1]) {
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < DIGEST_SIZE; i++) {
+        hex[2 * i] = digits[digest->bytes[i] >> 4];
+        hex[2 * i + 1] = digits[digest->bytes[i] & 15];
+    }
+    hex[HASH_SIZE] = '\0';
+}
+
+// MD5 (RFC 1321) pentru verificarea conținutului unui segment
+static const uint32_t md5_k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+static const uint8_t md5_r[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+};
+
+static void md5_block(uint32_t state[4], const uint8_t block[64]) {
+    uint32_t m[16];
+    for (int i = 0; i < 16; i++) {
+        m[i] = (uint32_t)block[4 * i] | (uint32_t)block[4 * i + 1] << 8 |
+               (uint32_t)block[4 * i + 2] << 16 | (uint32_t)block[4 * i + 3] << 24;
+    }
 
-cleanup_segments:
-    for (int i = 0; i < number_of_tasks; i++) {
-        for (int j = 0; j < MAX_FILES + 1; j++) {
-            free(data->all_files[i][j].segments);
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    for (int i = 0; i < 64; i++) {
+        uint32_t f;
+        int g;
+        if (i < 16) {
+            f = (b & c) | (~b & d);
+            g = i;
+        } else if (i < 32) {
+            f = (d & b) | (~d & c);
+            g = (5 * i + 1) & 15;
+        } else if (i < 48) {
+            f = b ^ c ^ d;
+            g = (3 * i + 5) & 15;
+        } else {
+            f = c ^ (b | ~d);
+            g = (7 * i) & 15;
         }
+
+        uint32_t rotated = a + f + md5_k[i] + m[g];
+        a = d;
+        d = c;
+        c = b;
+        b += rotated << md5_r[i] | rotated >> (32 - md5_r[i]);
     }
-cleanup_files:
-    for (int i = 0; i < number_of_tasks; i++) {
-        free(data->all_files[i]);
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+static void md5_digest(const void* data, size_t size, segment_digest* digest) {
+    uint32_t state[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+    const uint8_t* bytes = data;
+    size_t full = size & ~(size_t)63;
+
+    for (size_t offset = 0; offset < full; offset += 64) {
+        md5_block(state, bytes + offset);
     }
-    free(data->all_files);
-cleanup_seeds:
-    for (int i = 0; i < MAX_FILES + 1; i++) {
-        free(data->seeds[i]);
+
+    // Ultimul bloc: restul datelor, bitul 1, zerouri și lungimea în biți
+    uint8_t tail[128] = {0};
+    size_t rest = size - full;
+    memcpy(tail, bytes + full, rest);
+    tail[rest] = 0x80;
+    size_t tail_size = rest < 56 ? 64 : 128;
+    uint64_t bits = (uint64_t)size * 8;
+    for (int i = 0; i < 8; i++) {
+        tail[tail_size - 8 + i] = (uint8_t)(bits >> (8 * i));
     }
-    free(data->seeds);
-cleanup_swarms:
-    for (int i = 0; i < MAX_FILES + 1; i++) {
-        free(data->swarms[i]);
+    for (size_t offset = 0; offset < tail_size; offset += 64) {
+        md5_block(state, tail + offset);
+    }
+
+    for (int i = 0; i < 16; i++) {
+        digest->bytes[i] = (uint8_t)(state[i / 4] >> (8 * (i % 4)));
     }
-    free(data->swarms);
-cleanup_data:
-    free(data);
-    return NULL;
 }
 
-// Primire fișiere inițiale de la clienți
-#define CHECK_MPI(call) \
-    do { \
-        int ret = (call); \
-        if (ret != MPI_SUCCESS) { \
-            fprintf(stderr, "MPI error at %s:%d\n", __FILE__, __LINE__); \
-            MPI_Abort(MPI_COMM_WORLD, ret); \
-        } \
-    } while (0)
+// MD5 pe MD5_LANES segmente de aceeași lungime deodată: fiecare bandă a unui
+// vector urmărește starea altui segment (extensia vector_size din GCC, tradusă
+// în SSE2/NEON unde procesorul le are)
+#define MD5_LANES 4
+typedef uint32_t md5_vector __attribute__((vector_size(4 * MD5_LANES)));
+
+static void md5_block_lanes(md5_vector state[4], const uint8_t* const blocks[MD5_LANES]) {
+    md5_vector m[16];
+    for (int i = 0; i < 16; i++) {
+        for (int lane = 0; lane < MD5_LANES; lane++) {
+            const uint8_t* word = blocks[lane] + 4 * i;
+            m[i][lane] = (uint32_t)word[0] | (uint32_t)word[1] << 8 |
+                         (uint32_t)word[2] << 16 | (uint32_t)word[3] << 24;
+        }
+    }
 
+    md5_vector a = state[0], b = state[1], c = state[2], d = state[3];
+    for (int i = 0; i < 64; i++) {
+        md5_vector f;
+        int g;
+        if (i < 16) {
+            f = (b & c) | (~b & d);
+            g = i;
+        } else if (i < 32) {
+            f = (d & b) | (~d & c);
+            g = (5 * i + 1) & 15;
+        } else if (i < 48) {
+            f = b ^ c ^ d;
+            g = (3 * i + 5) & 15;
+        } else {
+            f = c ^ (b | ~d);
+            g = (7 * i) & 15;
+        }
 
-// Validează ID-ul fișierului
-static inline int validate_file_id(int file_id, int sender) {
-    if (file_id < 0 || file_id > MAX_FILES) {
-        fprintf(stderr, "Invalid file_id %d from sender %d\n", file_id, sender);
-        return 0;
+        md5_vector rotated = a + f + md5_k[i] + m[g];
+        a = d;
+        d = c;
+        c = b;
+        b += rotated << md5_r[i] | rotated >> (32 - md5_r[i]);
     }
-    return 1;
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
 }
 
-// Primește și procesează informațiile despre un segment
-static int receive_segment_info(TrackerData* data, int file_id, int sender, int segment_id) {
-    if (!data->all_files[sender][file_id].segments) {
-        fprintf(stderr, "Null segments array for file %d from sender %d\n", file_id, sender);
-        return -1;
+static void md5_digest_lanes(const uint8_t* const data[MD5_LANES], size_t size,
+                             segment_digest digests[MD5_LANES]) {
+    md5_vector state[4];
+    for (int lane = 0; lane < MD5_LANES; lane++) {
+        state[0][lane] = 0x67452301;
+        state[1][lane] = 0xefcdab89;
+        state[2][lane] = 0x98badcfe;
+        state[3][lane] = 0x10325476;
     }
 
-    CHECK_MPI(MPI_Recv(data->all_files[sender][file_id].segments[segment_id],
-                      HASH_SIZE + 1, MPI_CHAR, sender, 0,
-                      MPI_COMM_WORLD, MPI_STATUS_IGNORE));
+    const uint8_t* blocks[MD5_LANES];
+    size_t full = size & ~(size_t)63;
+    for (size_t offset = 0; offset < full; offset += 64) {
+        for (int lane = 0; lane < MD5_LANES; lane++) {
+            blocks[lane] = data[lane] + offset;
+        }
+        md5_block_lanes(state, blocks);
+    }
 
-    // Verifică dacă hash-ul primit este valid
-    if (strlen(data->all_files[sender][file_id].segments[segment_id]) != HASH_SIZE) {
-        fprintf(stderr, "Invalid hash length for file %d, segment %d from sender %d\n",
-                file_id, segment_id, sender);
-        return -1;
+    // Completarea este aceeași pe toate benzile, doar restul datelor diferă
+    uint8_t tail[MD5_LANES][128] = {{0}};
+    size_t rest = size - full;
+    size_t tail_size = rest < 56 ? 64 : 128;
+    uint64_t bits = (uint64_t)size * 8;
+    for (int lane = 0; lane < MD5_LANES; lane++) {
+        memcpy(tail[lane], data[lane] + full, rest);
+        tail[lane][rest] = 0x80;
+        for (int i = 0; i < 8; i++) {
+            tail[lane][tail_size - 8 + i] = (uint8_t)(bits >> (8 * i));
+        }
+    }
+    for (size_t offset = 0; offset < tail_size; offset += 64) {
+        for (int lane = 0; lane < MD5_LANES; lane++) {
+            blocks[lane] = tail[lane] + offset;
+        }
+        md5_block_lanes(state, blocks);
     }
 
-    return 0;
+    for (int lane = 0; lane < MD5_LANES; lane++) {
+        for (int i = 0; i < 16; i++) {
+            digests[lane].bytes[i] = (uint8_t)(state[i / 4][lane] >> (8 * (i % 4)));
+        }
+    }
 }
 
-// Primește și procesează informațiile despre un fișier
-static int receive_file_info(TrackerData* data, int sender) {
-    int file_id;
-    CHECK_MPI(MPI_Recv(&file_id, 1, MPI_INT, sender, 0, 
-                      MPI_COMM_WORLD, MPI_STATUS_IGNORE));
-    
-    if (!validate_file_id(file_id, sender)) {
-        return -1;
+// FNV-1a pe numele fișierului
+static uint32_t name_hash(const char* name) {
+    uint32_t hash = 2166136261u;
+    for (; *name; name++) {
+        hash = (hash ^ (uint8_t)*name) * 16777619u;
     }
+    return hash;
+}
+
+// Politica de alegere a peer-ului pentru un segment, aleasă la pornire
+// prin variabila de mediu TEMA2_PEER_POLICY
+typedef enum {
+    POLICY_FIRST,                      // Primul peer care are segmentul
+    POLICY_LEAST_OUTSTANDING,          // Peer-ul cu cele mai puține cereri în curs
+    POLICY_ROUND_ROBIN,                // Peers parcurși pe rând
+    POLICY_LATENCY,                    // EWMA a timpului de răspuns, ponderată cu încărcarea
+    POLICY_COUNT
+} PeerPolicy;
+
+typedef struct {
+    int rank;
+    int number_of_files;
+    int number_of_tasks;
+    PeerPolicy peer_policy;
+    int gossip;                        // Schimb de BITFIELD/HAVE între peers
+    int endgame;                       // Pragul de segmente lipsă pentru endgame
+} Peer_args;
+
+// Fișierele sunt împărțite între trackere după hash-ul numelui; ID-ul global
+// al unui fișier este ID-ul local din shard * n_trackers + shard, deci
+// shard-ul care răspunde de un fișier se află direct din ID
+int n_trackers = TRACKER_SHARDS;
+MPI_Comm termination_comm;             // Doar pentru bariera de terminare
+
+static inline int tracker_for_name(const char* name) {
+    return name_hash(name) % n_trackers;
+}
+
+static inline int tracker_for_file(int file_id) {
+    return file_id % n_trackers;
+}
+
+file_info* users_files;                // Indexat după ID după semnalul de start
+int n_known_files;                     // Fișierele din dicționarul tracker-ului
+file_info* wish_list;
 
-    // Marchează sender-ul în swarm și seeds
-    data->swarms[file_id][sender] = 1;
-    data->seeds[file_id][sender] = 1;
 
-    // Primește numărul de segmente
+
+// Membru al swarm-ului unui fișier: un rank care deține cel puțin un segment.
+// Bitset-ul are BITMAP_WORDS(n_segments) cuvinte, deci memoria tracker-ului
+// crește doar cu ce se partajează efectiv
+typedef struct {
+    int rank;
+    int update_seq;                    // Ultima actualizare aplicată
+    uint64_t* bits;                    // Segmentele deținute
+} SwarmMember;
+
+// Starea unui fișier în tracker: tabela canonică de hash-uri (o singură copie)
+// și lista membrilor swarm-ului, ordonată după rank
+typedef struct TrackerFile {
+    char name[MAX_FILENAME];
     int n_segments;
-    CHECK_MPI(MPI_Recv(&n_segments, 1, MPI_INT, sender, 0,
-                      MPI_COMM_WORLD, MPI_STATUS_IGNORE));
+    segment_digest* hashes;            // Hash-ul fiecărui segment
+    int* replicas;                     // Câți clienți dețin fiecare segment
+    SwarmMember* members;
+    int n_members;
+    int members_capacity;
+    int* subscribers;                  // Clienții care descarcă fișierul
+    int n_subscribers;
+    int subscribers_capacity;
+} TrackerFile;
+
+// Starea fiecărui rank din perspectiva tracker-ului
+typedef enum {
+    CLIENT_UNREGISTERED,               // Nu a trimis încă mesajul de înregistrare
+    CLIENT_ACTIVE,                     // Înregistrat; poate trimite cereri și actualizări
+} ClientState;
 
-    if (n_segments <= 0 || n_segments > MAX_CHUNKS) {
-        fprintf(stderr, "Invalid number of segments %d for file %d from sender %d\n",
-                n_segments, file_id, sender);
-        return -1;
-    }
+// Răspuns trimis neblocant, încă neterminat
+typedef struct {
+    MPI_Request request;
+    void* buffer;                      // Eliberat la final; NULL pentru buffere statice
+} PendingSend;
+
+// Trimiterile în curs către destinatarii unui shard
+typedef struct {
+    pthread_mutex_t lock;              // Workerii trimit și ei, în modul paralel
+    PendingSend* sends;
+    int n_sends;
+    int capacity;
+} SendShard;
 
-    // Actualizează informațiile despre fișier
-    data->all_files[sender][file_id].file_number = file_id;
-    data->all_files[sender][file_id].n_segments = n_segments;
+struct TrackerPool;
 
-    // Actualizează numărul de segmente pentru toți clienții
-    for (int k = 1; k < data->number_of_tasks; k++) {
-        data->all_files[k][file_id].n_segments = n_segments;
-    }
+typedef struct TrackerData {
+    int shard;                         // Rank-ul acestui tracker
+    TrackerFile* files;                // Indexat după ID-ul local atribuit la înregistrare
+    int n_files;
+    int files_capacity;
+    int* names;                        // Dicționar nume -> ID, adresare deschisă (-1 = liber)
+    int names_capacity;                // Putere a lui 2
+    ClientState* clients;              // [rank]
+    SendShard sends[TRACKER_SEND_SHARDS];
+    struct TrackerPool* pool;          // Workerii, în modul paralel; altfel NULL
+    int number_of_tasks;
+    int n_clients;
+} TrackerData;
 
-    // Primește hash-urile pentru toate segmentele
-    for (int k = 0; k < n_segments; k++) {
-        if (receive_segment_info(data, file_id, sender, k) < 0) {
-            return -1;
+// Slotul din dicționar care conține numele sau primul slot liber
+static int* name_slot(int* names, int capacity, const TrackerFile* files, const char* name) {
+    for (uint32_t i = name_hash(name) & (capacity - 1);; i = (i + 1) & (capacity - 1)) {
+        if (names[i] < 0 || (files && strcmp(files[names[i]].name, name) == 0)) {
+            return &names[i];
         }
     }
-
-    return 0;
 }
 
-void receive_initial_files(TrackerData* data) {
-    if (!data) {
-        fprintf(stderr, "Invalid tracker data pointer\n");
-        return;
+static int grow_names(TrackerData* data) {
+    int capacity = data->names_capacity ? data->names_capacity * 2 : 16;
+    int* names = malloc(capacity * sizeof(int));
+    if (!names) {
+        return -1;
     }
+    memset(names, 0xff, capacity * sizeof(int));
 
-    int successful_receptions = 0;
-    int expected_receptions = data->number_of_tasks - 1;
-
-    while (successful_receptions < expected_receptions) {
-        MPI_Status status;
-        int number_of_files = 0;
+    // Numele sunt unice, deci reinserarea nu are nevoie de comparații
+    for (int id = 0; id < data->n_files; id++) {
+        *name_slot(names, capacity, NULL, data->files[id].name) = id;
+    }
 
-        // Primește numărul de fișiere de la un client
-        CHECK_MPI(MPI_Recv(&number_of_files, 1, MPI_INT, MPI_ANY_SOURCE, 0, 
-                          MPI_COMM_WORLD, &status));
-        int sender = status.MPI_SOURCE;
+    free(data->names);
+    data->names = names;
+    data->names_capacity = capacity;
+    return 0;
+}
 
-        if (number_of_files < 0 || number_of_files > MAX_FILES) {
-            fprintf(stderr, "Invalid number of files %d from sender %d\n", number_of_files, sender);
-            continue;
+// ID-ul fișierului cu numele dat, înregistrat la prima apariție; -1 la eroare
+static int file_id_for_name(TrackerData* data, const char* name) {
+    if (data->names_capacity) {
+        int id = *name_slot(data->names, data->names_capacity, data->files, name);
+        if (id >= 0) {
+            return id;
         }
+    }
 
-        // Procesează fiecare fișier
-        int files_processed = 0;
-        for (int j = 0; j < number_of_files; j++) {
-            if (receive_file_info(data, sender) == 0) {
-                files_processed++;
-            }
+    if (2 * (data->n_files + 1) > data->names_capacity && grow_names(data) < 0) {
+        return -1;
+    }
+    if (data->n_files == data->files_capacity) {
+        int capacity = data->files_capacity ? data->files_capacity * 2 : 8;
+        TrackerFile* files = realloc(data->files, capacity * sizeof(TrackerFile));
+        if (!files) {
+            return -1;
         }
+        data->files = files;
+        data->files_capacity = capacity;
+    }
 
-        if (files_processed == number_of_files) {
-            successful_receptions++;
+    int id = data->n_files++;
+    memset(&data->files[id], 0, sizeof(TrackerFile));
+    strcpy(data->files[id].name, name);
+    *name_slot(data->names, data->names_capacity, data->files, name) = id;
+    return id;
+}
+
+// Membrul swarm-ului pentru rank; cu create, este adăugat dacă lipsește
+static SwarmMember* find_member(TrackerFile* file, int rank, int create) {
+    int low = 0, high = file->n_members;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (file->members[mid].rank < rank) {
+            low = mid + 1;
         } else {
-            fprintf(stderr, "Only %d/%d files successfully processed from sender %d\n",
-                    files_processed, number_of_files, sender);
+            high = mid;
+        }
+    }
+    if (low < file->n_members && file->members[low].rank == rank) {
+        return &file->members[low];
+    }
+    if (!create) {
+        return NULL;
+    }
+
+    if (file->n_members == file->members_capacity) {
+        int capacity = file->members_capacity ? file->members_capacity * 2 : 4;
+        SwarmMember* members = realloc(file->members, capacity * sizeof(SwarmMember));
+        if (!members) {
+            return NULL;
         }
+        file->members = members;
+        file->members_capacity = capacity;
     }
 
-    fprintf(stderr, "Successfully received files from all %d clients\n",
-            successful_receptions);
-}
+    uint64_t* bits = calloc(BITMAP_WORDS(file->n_segments), sizeof(uint64_t));
+    if (!bits) {
+        return NULL;
+    }
 
-// Funcție auxiliară pentru a trimite detaliile unui segment către un client
-void send_segment_request(int sender, int segment_id, int peer_id, const char* segment_hash) {
-    int signal = MSG_SEGMENT;
-    CHECK_MPI(MPI_Send(&signal, 1, MPI_INT, sender, 0, MPI_COMM_WORLD));
-    CHECK_MPI(MPI_Send(&segment_id, 1, MPI_INT, sender, 0, MPI_COMM_WORLD));
-    CHECK_MPI(MPI_Send(&peer_id, 1, MPI_INT, sender, 0, MPI_COMM_WORLD));
-    CHECK_MPI(MPI_Send(segment_hash, HASH_SIZE + 1, MPI_CHAR, sender, 0, MPI_COMM_WORLD));
+    memmove(&file->members[low + 1], &file->members[low],
+            (file->n_members - low) * sizeof(SwarmMember));
+    file->members[low] = (SwarmMember){.rank = rank, .bits = bits};
+    file->n_members++;
+    return &file->members[low];
 }
 
-// Procesare cerere segment
-void handle_segment_request1(TrackerData* data, int sender) {
-    int file_id;
-    CHECK_MPI(MPI_Recv(&file_id, 1, MPI_INT, sender, 0, 
-                      MPI_COMM_WORLD, MPI_STATUS_IGNORE));
-
-    if (file_id < 0 || file_id > MAX_FILES) {
-        fprintf(stderr, "Invalid file_id %d in request\n", file_id);
-        return;
+// Marchează segmentul ca deținut de membru; replicile cresc doar pentru biții
+// noi. Întoarce 1 dacă segmentul nu era deja deținut.
+static inline int grant_segment(TrackerFile* file, SwarmMember* member, int segment) {
+    if (!bitmap_test(member->bits, segment)) {
+        bitmap_set(member->bits, segment);
+        file->replicas[segment]++;
+        return 1;
     }
+    return 0;
+}
 
-    // Trimite numărul de segmente
-    for (int i = 1; i < data->number_of_tasks; i++) {
-        if (data->swarms[file_id][i]) {
-            CHECK_MPI(MPI_Send(&data->all_files[i][file_id].n_segments, 1, MPI_INT,
-                              sender, 0, MPI_COMM_WORLD));
-            break;
+// Toate segmentele fișierului devin deținute de membru, cuvânt cu cuvânt;
+// segmentele noi sunt scrise în added_ids (dacă nu e NULL), iar numărul lor e întors
+static int grant_all_segments(TrackerFile* file, SwarmMember* member, int* added_ids) {
+    uint64_t* bits = member->bits;
+    int n = file->n_segments;
+    int n_added = 0;
+
+    for (int w = 0; w < BITMAP_WORDS(n); w++) {
+        uint64_t full = (w + 1) * 64 <= n ? ~0ULL : (1ULL << (n & 63)) - 1;
+        uint64_t added = full & ~bits[w];
+        bits[w] |= added;
+
+        while (added) {
+            int segment = w * 64 + __builtin_ctzll(added);
+            file->replicas[segment]++;
+            if (added_ids) {
+                added_ids[n_added] = segment;
+            }
+            n_added++;
+            added &= added - 1;
         }
     }
+    return n_added;
+}
 
-    // Trimite lista de peers și segmentele lor
-    for (int i = 1; i < data->number_of_tasks; i++) {
-        if ((data->swarms[file_id][i] || data->seeds[file_id][i]) && i != sender) {
-            for (int j = 0; j < data->all_files[i][file_id].n_segments; j++) {
-                if (strlen(data->all_files[i][file_id].segments[j]) > 0) {
-                    send_segment_request(sender, j, i, data->all_files[i][file_id].segments[j]);
-                }
-            }
-        }
+// Inițializare structuri tracker; fișierele se adaugă la înregistrare
+TrackerData* init_tracker(int number_of_tasks, int shard) {
+    TrackerData* data = calloc(1, sizeof(TrackerData));
+    if (!data) {
+        return NULL;
+    }
+    data->shard = shard;
+    data->number_of_tasks = number_of_tasks;
+    data->n_clients = number_of_tasks - n_trackers;
+
+    data->clients = calloc(number_of_tasks, sizeof(ClientState));
+    if (!data->clients) {
+        free(data);
+        return NULL;
+    }
+    for (int i = 0; i < TRACKER_SEND_SHARDS; i++) {
+        pthread_mutex_init(&data->sends[i].lock, NULL);
     }
 
-    int signal = MSG_END_OF_MESSAGE;
-    CHECK_MPI(MPI_Send(&signal, 1, MPI_INT, sender, 0, MPI_COMM_WORLD));
+    return data;
 }
 
+// Primire fișiere inițiale de la clienți
+#define CHECK_MPI(call) \
+    do { \
+        int ret = (call); \
+        if (ret != MPI_SUCCESS) { \
+            fprintf(stderr, "MPI error at %s:%d\n", __FILE__, __LINE__); \
+            MPI_Abort(MPI_COMM_WORLD, ret); \
+        } \
+    } while (0)
+
+
+// Metrici de performanță, active doar dacă TEMA2_METRICS numește fișierul de
+// raport. Fiecare thread acumulează în propriul bloc, fără sincronizare; la
+// final blocurile sunt însumate per rank și colectate de rank-ul 0, care
+// scrie un singur raport JSON pentru toată rularea.
+typedef enum {
+    METRIC_REGISTRATION,
+    METRIC_START,
+    METRIC_PEER_LIST_REQUEST,
+    METRIC_PEER_LIST,
+    METRIC_UPDATE,
+    METRIC_FINISH,
+    METRIC_CANCEL,
+    METRIC_AVAILABILITY,
+    METRIC_SEGMENT_REQUEST,
+    METRIC_SEGMENT_REPLY,
+    METRIC_SEGMENT_PAYLOAD,
+    METRIC_GOSSIP,
+    METRIC_MESSAGE_COUNT
+} MetricMessage;
+
+static const char* const metric_message_names[METRIC_MESSAGE_COUNT] = {
+    "registration", "start", "peer_list_request", "peer_list", "update", "finish", "cancel",
+    "availability", "segment_request", "segment_reply", "segment_payload", "gossip",
+};
 
-// Procesare actualizare de la client
-void handle_update(TrackerData* data, int sender) {
-    while (1) {
-        int signal;
-        CHECK_MPI(MPI_Recv(&signal, 1, MPI_INT, sender, 1, 
-                          MPI_COMM_WORLD, MPI_STATUS_IGNORE));
+typedef enum {
+    HISTOGRAM_TRACKER_SERVICE,         // Procesarea unui mesaj de către tracker (us)
+    HISTOGRAM_PEER_ACK,                // De la cererea de segmente la răspuns (us)
+    HISTOGRAM_FILE_DOWNLOAD,           // Descărcarea unui fișier întreg (us)
+    HISTOGRAM_UPLOAD_QUEUE_DEPTH,      // Adâncimea cozii de upload la fiecare cerere
+    METRIC_HISTOGRAM_COUNT
+} MetricHistogram;
 
-        if (signal == MSG_END_OF_MESSAGE) break;
+static const char* const metric_histogram_names[METRIC_HISTOGRAM_COUNT] = {
+    "tracker_service_us", "peer_ack_us", "file_download_us", "upload_queue_depth",
+};
 
-        if (signal == MSG_SEGMENT) {
-            int segment_id, file_id;
-            CHECK_MPI(MPI_Recv(&segment_id, 1, MPI_INT, sender, 0,
-                              MPI_COMM_WORLD, MPI_STATUS_IGNORE));
-            CHECK_MPI(MPI_Recv(&file_id, 1, MPI_INT, sender, 0,
-                              MPI_COMM_WORLD, MPI_STATUS_IGNORE));
+// Bucket-ul 0 numără valorile sub 1, bucket-ul b > 0 intervalul [2^(b-1), 2^b)
+#define METRIC_BUCKETS 32
 
-            if (file_id < 0 || file_id > MAX_FILES ||
-                segment_id < 0 || segment_id >= MAX_CHUNKS) {
-                fprintf(stderr, "Invalid update: file_id=%d, segment_id=%d\n",
-                        file_id, segment_id);
-                continue;
-            }
+typedef struct {
+    long long count;
+    double sum;
+    double max;
+    long long buckets[METRIC_BUCKETS];
+} Histogram;
 
-            CHECK_MPI(MPI_Recv(data->all_files[sender][file_id].segments[segment_id],
-                              HASH_SIZE + 1, MPI_CHAR, sender, 0,
-                              MPI_COMM_WORLD, MPI_STATUS_IGNORE));
-            data->swarms[file_id][sender] = 1;
+typedef struct {
+    long long sent[METRIC_MESSAGE_COUNT];
+    long long sent_bytes[METRIC_MESSAGE_COUNT];
+    long long received[METRIC_MESSAGE_COUNT];
+    long long received_bytes[METRIC_MESSAGE_COUNT];
+    Histogram histograms[METRIC_HISTOGRAM_COUNT];
+    double first_segment;              // Secunde până la primul segment primit
+    double completed;                  // Secunde până la terminarea descărcărilor
+} MetricsData;
+
+typedef struct ThreadMetrics {
+    MetricsData data;
+    struct ThreadMetrics* next;
+} ThreadMetrics;
+
+static const char* metrics_path;       // NULL = metrici dezactivate
+static ThreadMetrics* metrics_threads;
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread ThreadMetrics* thread_metrics;
+static double metrics_first_segment, metrics_completed;
+
+// Blocul thread-ului curent, înregistrat la prima folosire
+static MetricsData* metrics_local(void) {
+    if (!thread_metrics) {
+        ThreadMetrics* block = calloc(1, sizeof(ThreadMetrics));
+        if (!block) {
+            return NULL;
         }
+        pthread_mutex_lock(&metrics_lock);
+        block->next = metrics_threads;
+        metrics_threads = block;
+        pthread_mutex_unlock(&metrics_lock);
+        thread_metrics = block;
     }
+    return &thread_metrics->data;
 }
 
-// Eliberare memorie
-void cleanup_tracker(TrackerData* data) {
-    if (!data) return;
+static inline void metric_sent(MetricMessage type, long long bytes) {
+    MetricsData* metrics = metrics_path ? metrics_local() : NULL;
+    if (metrics) {
+        metrics->sent[type]++;
+        metrics->sent_bytes[type] += bytes;
+    }
+}
 
-    if (data->all_files) {
-        for (int i = 0; i < data->number_of_tasks; i++) {
-            if (data->all_files[i]) {
-                for (int j = 0; j < MAX_FILES + 1; j++) {
-                    free(data->all_files[i][j].segments);
-                }
-                free(data->all_files[i]);
-            }
-        }
-        free(data->all_files);
+static inline void metric_received(MetricMessage type, long long bytes) {
+    MetricsData* metrics = metrics_path ? metrics_local() : NULL;
+    if (metrics) {
+        metrics->received[type]++;
+        metrics->received_bytes[type] += bytes;
+    }
+}
+
+static inline void metric_observe(MetricHistogram id, double value) {
+    MetricsData* metrics = metrics_path ? metrics_local() : NULL;
+    if (!metrics) {
+        return;
     }
 
-    if (data->swarms) {
-        for (int i = 0; i < MAX_FILES + 1; i++) {
-            free(data->swarms[i]);
-        }
-        free(data->swarms);
+    Histogram* histogram = &metrics->histograms[id];
+    int bucket = 0;
+    while (bucket < METRIC_BUCKETS - 1 && value >= (double)(1ULL << bucket)) {
+        bucket++;
     }
+    histogram->count++;
+    histogram->sum += value;
+    histogram->buckets[bucket]++;
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+}
+
+// Momentele descărcării, în secunde de la pornirea thread-ului de download
+static inline void metric_timeline(double first_segment, double completed) {
+    metrics_first_segment = first_segment;
+    metrics_completed = completed;
+}
 
-    if (data->seeds) {
-        for (int i = 0; i < MAX_FILES + 1; i++) {
-            free(data->seeds[i]);
+static void metrics_merge(MetricsData* into, const MetricsData* from) {
+    for (int t = 0; t < METRIC_MESSAGE_COUNT; t++) {
+        into->sent[t] += from->sent[t];
+        into->sent_bytes[t] += from->sent_bytes[t];
+        into->received[t] += from->received[t];
+        into->received_bytes[t] += from->received_bytes[t];
+    }
+    for (int h = 0; h < METRIC_HISTOGRAM_COUNT; h++) {
+        Histogram* a = &into->histograms[h];
+        const Histogram* b = &from->histograms[h];
+        a->count += b->count;
+        a->sum += b->sum;
+        if (b->max > a->max) {
+            a->max = b->max;
+        }
+        for (int k = 0; k < METRIC_BUCKETS; k++) {
+            a->buckets[k] += b->buckets[k];
         }
-        free(data->seeds);
     }
+    if (from->first_segment > into->first_segment) {
+        into->first_segment = from->first_segment;
+    }
+    if (from->completed > into->completed) {
+        into->completed = from->completed;
+    }
+}
 
-    free(data);
+static void metrics_write_data(FILE* out, const MetricsData* data) {
+    fprintf(out, "\"first_segment_s\": %.6f, \"completed_s\": %.6f, \"messages\": {",
+            data->first_segment, data->completed);
+    for (int t = 0; t < METRIC_MESSAGE_COUNT; t++) {
+        fprintf(out, "%s\"%s\": {\"sent\": %lld, \"sent_bytes\": %lld, \"received\": %lld, "
+                "\"received_bytes\": %lld}", t ? ", " : "", metric_message_names[t], data->sent[t],
+                data->sent_bytes[t], data->received[t], data->received_bytes[t]);
+    }
+    fprintf(out, "}, \"histograms\": {");
+    for (int h = 0; h < METRIC_HISTOGRAM_COUNT; h++) {
+        const Histogram* histogram = &data->histograms[h];
+        fprintf(out, "%s\"%s\": {\"count\": %lld, \"mean\": %.3f, \"max\": %.3f, \"buckets\": [",
+                h ? ", " : "", metric_histogram_names[h], histogram->count,
+                histogram->count ? histogram->sum / histogram->count : 0.0, histogram->max);
+
+        // Bucket-urile goale de la sfârșit nu sunt scrise
+        int last = METRIC_BUCKETS - 1;
+        while (last >= 0 && histogram->buckets[last] == 0) {
+            last--;
+        }
+        for (int k = 0; k <= last; k++) {
+            fprintf(out, "%s%lld", k ? ", " : "", histogram->buckets[k]);
+        }
+        fprintf(out, "]}");
+    }
+    fprintf(out, "}");
 }
 
-void tracker(int number_of_tasks, int rank) {
-    // Inițializare tracker
-    TrackerData* data = init_tracker(number_of_tasks);
-    if (!data) {
-        fprintf(stderr, "Failed to initialize tracker\n");
+// Colectiv pe MPI_COMM_WORLD, apelat de toate rank-urile după oprirea
+// thread-urilor; rank-ul 0 scrie raportul, cu fiecare rank și totalul
+static void metrics_report(int rank, int number_of_tasks) {
+    if (!metrics_path) {
         return;
     }
 
-    // Primire fișiere inițiale
-    receive_initial_files(data);
+    MetricsData local = {0};
+    pthread_mutex_lock(&metrics_lock);
+    while (metrics_threads) {
+        ThreadMetrics* block = metrics_threads;
+        metrics_threads = block->next;
+        metrics_merge(&local, &block->data);
+        free(block);
+    }
+    thread_metrics = NULL;
+    pthread_mutex_unlock(&metrics_lock);
+    local.first_segment = metrics_first_segment;
+    local.completed = metrics_completed;
+
+    MetricsData* all = rank == 0 ? malloc(number_of_tasks * sizeof(MetricsData)) : NULL;
+    if (rank == 0 && !all) {
+        fprintf(stderr, "Failed to allocate metrics report\n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    CHECK_MPI(MPI_Gather(&local, sizeof(MetricsData), MPI_BYTE, all, sizeof(MetricsData), MPI_BYTE,
+                         0, MPI_COMM_WORLD));
+    if (rank != 0) {
+        return;
+    }
 
-    // Trimite semnal de start către toți clienții
-    int signal = MSG_ACK;
-    for (int i = 1; i < number_of_tasks; i++) {
-        CHECK_MPI(MPI_Send(&signal, 1, MPI_INT, i, 0, MPI_COMM_WORLD));
+    FILE* out = fopen(metrics_path, "w");
+    if (!out) {
+        fprintf(stderr, "Error opening file %s for writing\n", metrics_path);
+        free(all);
+        return;
     }
 
-    // Loop principal
-    while (data->n_clients > 0) {
-        MPI_Status status;
-        CHECK_MPI(MPI_Recv(&signal, 1, MPI_INT, MPI_ANY_SOURCE, 1,
-                          MPI_COMM_WORLD, &status));
-        int sender = status.MPI_SOURCE;
+    MetricsData total = {0};
+    fprintf(out, "{\"ranks\": [\n");
+    for (int r = 0; r < number_of_tasks; r++) {
+        fprintf(out, "  {\"rank\": %d, \"role\": \"%s\", ", r, r < n_trackers ? "tracker" : "client");
+        metrics_write_data(out, &all[r]);
+        fprintf(out, "}%s\n", r + 1 < number_of_tasks ? "," : "");
+        metrics_merge(&total, &all[r]);
+    }
+    fprintf(out, "],\n\"total\": {");
+    metrics_write_data(out, &total);
+    fprintf(out, "}}\n");
+    fclose(out);
+    free(all);
+}
 
-        switch (signal) {
-            case MSG_REQUEST:
-                handle_segment_request1(data, sender);
-                break;
 
-            case MSG_UPDATE:
-                handle_update(data, sender);
-                break;
+// Trasare opțională, activă doar dacă TEMA2_TRACE dă prefixul fișierelor.
+// Fiecare thread scrie intervale într-un buffer circular propriu, fără
+// sincronizare (păstrează ultimele TRACE_EVENTS); la ieșire fiecare rank scrie
+// <prefix>.<rank>.json în formatul Chrome trace-event, cu pid = rank.
+#ifndef TRACE_EVENTS
+#define TRACE_EVENTS 16384             // Putere a lui 2
+#endif
 
-            case MSG_FINISH: {
-                int file_id;
-                CHECK_MPI(MPI_Recv(&file_id, 1, MPI_INT, sender, 0,
-                                  MPI_COMM_WORLD, MPI_STATUS_IGNORE));
-
-                if (file_id >= 0 && file_id <= MAX_FILES) {
-                    for (int i = 1; i < number_of_tasks; i++) {
-                        if (data->seeds[file_id][i]) {
-                            for (int j = 0; j < data->all_files[i][file_id].n_segments; j++) {
-                                strncpy(data->all_files[sender][file_id].segments[j],
-                                      data->all_files[i][file_id].segments[j],
-                                      HASH_SIZE);
-                                data->all_files[sender][file_id].segments[j][HASH_SIZE] = '\0';
-                            }
-                        }
-                    }
-                    data->seeds[file_id][sender] = 1;
-                }
-                break;
-            }
+typedef struct {
+    const char* name;
+    const char* arg_name;
+    int arg;
+    double begin;                      // us, CLOCK_REALTIME (comun între rank-uri)
+    double duration;
+} TraceEvent;
+
+typedef struct TraceBuffer {
+    const char* thread_name;
+    int tid;
+    unsigned long long written;
+    TraceEvent events[TRACE_EVENTS];
+    struct TraceBuffer* next;
+} TraceBuffer;
+
+static const char* trace_prefix;       // NULL = trasare dezactivată
+static TraceBuffer* trace_buffers;
+static int trace_threads;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread TraceBuffer* thread_trace;
+static __thread const char* thread_trace_name;
+
+static inline double trace_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
 
-            case MSG_TERMINATE:
-                data->n_clients--;
-                break;
+// Numele thread-ului curent în trasare
+static inline void trace_thread(const char* name) {
+    thread_trace_name = name;
+}
+
+static inline double trace_begin(void) {
+    return trace_prefix ? trace_now() : 0;
+}
+
+static void trace_end(const char* name, double begin, const char* arg_name, int arg) {
+    if (!trace_prefix) {
+        return;
+    }
+    double end = trace_now();
+
+    if (!thread_trace) {
+        TraceBuffer* buffer = malloc(sizeof(TraceBuffer));
+        if (!buffer) {
+            return;
         }
+        buffer->thread_name = thread_trace_name ? thread_trace_name : "main";
+        buffer->written = 0;
+        pthread_mutex_lock(&trace_lock);
+        buffer->tid = trace_threads++;
+        buffer->next = trace_buffers;
+        trace_buffers = buffer;
+        pthread_mutex_unlock(&trace_lock);
+        thread_trace = buffer;
+    }
+
+    TraceEvent* event = &thread_trace->events[thread_trace->written++ & (TRACE_EVENTS - 1)];
+    *event = (TraceEvent){.name = name, .arg_name = arg_name, .arg = arg, .begin = begin,
+                          .duration = end - begin};
+}
+
+// Apelat după oprirea thread-urilor; fișierul fiecărui rank este un trace valid
+// de sine stătător, iar bench/merge_traces.py le unește
+static void trace_write(int rank) {
+    if (!trace_prefix) {
+        return;
     }
 
-    // Trimite semnal de terminare către toți clienții
-    signal = MSG_TERMINATE;
-    for (int i = 1; i < number_of_tasks; i++) {
-        CHECK_MPI(MPI_Send(&signal, 1, MPI_INT, i, 1, MPI_COMM_WORLD));
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s.%d.json", trace_prefix, rank);
+    FILE* out = fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "Error opening file %s for writing\n", path);
+        return;
     }
 
-    cleanup_tracker(data);
+    unsigned long long dropped = 0;
+    fprintf(out, "{\"traceEvents\": [\n");
+    fprintf(out, "{\"ph\": \"M\", \"name\": \"process_name\", \"pid\": %d, \"tid\": 0, "
+            "\"args\": {\"name\": \"%s %d\"}}", rank, rank < n_trackers ? "tracker" : "client", rank);
+    fprintf(out, ",\n{\"ph\": \"M\", \"name\": \"process_sort_index\", \"pid\": %d, \"tid\": 0, "
+            "\"args\": {\"sort_index\": %d}}", rank, rank);
+
+    while (trace_buffers) {
+        TraceBuffer* buffer = trace_buffers;
+        trace_buffers = buffer->next;
+        fprintf(out, ",\n{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": %d, \"tid\": %d, "
+                "\"args\": {\"name\": \"%s\"}}", rank, buffer->tid, buffer->thread_name);
+
+        unsigned long long first = buffer->written > TRACE_EVENTS ? buffer->written - TRACE_EVENTS : 0;
+        dropped += first;
+        for (unsigned long long i = first; i < buffer->written; i++) {
+            const TraceEvent* event = &buffer->events[i & (TRACE_EVENTS - 1)];
+            fprintf(out, ",\n{\"ph\": \"X\", \"name\": \"%s\", \"pid\": %d, \"tid\": %d, "
+                    "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"%s\": %d}}", event->name, rank,
+                    buffer->tid, event->begin, event->duration, event->arg_name, event->arg);
+        }
+        free(buffer);
+    }
+    thread_trace = NULL;
+
+    fprintf(out, "\n], \"displayTimeUnit\": \"ms\", \"otherData\": {\"rank\": %d, \"dropped\": %llu}}\n",
+            rank, dropped);
+    fclose(out);
+}
+
+// Validează ID-ul global al fișierului: trebuie să fie al unui fișier din acest
+// shard, înregistrat de un seed. Întoarce ID-ul local sau -1.
+static inline int local_file_id(const TrackerData* data, int file_id, int sender) {
+    int local = file_id / n_trackers;
+    if (file_id < 0 || tracker_for_file(file_id) != data->shard || local >= data->n_files ||
+        data->files[local].n_segments == 0) {
+        fprintf(stderr, "Invalid file_id %d from sender %d\n", file_id, sender);
+        return -1;
+    }
+    return local;
+}
+
+// Înregistrează un fișier anunțat de sender; primul seed completează tabela
+// canonică de hash-uri, ceilalți sunt doar verificați față de ea
+static int register_file(TrackerData* data, int sender, const char* name, int n_segments,
+                         const segment_digest* hashes) {
+    int file_id = file_id_for_name(data, name);
+    if (file_id < 0) {
+        fprintf(stderr, "Failed to register file %s from sender %d\n", name, sender);
+        return -1;
+    }
+
+    TrackerFile* file = &data->files[file_id];
+    if (n_segments <= 0 || (file->n_segments && file->n_segments != n_segments)) {
+        fprintf(stderr, "Invalid number of segments %d for file %s from sender %d\n",
+                n_segments, name, sender);
+        return -1;
+    }
+
+    if (file->n_segments == 0) {
+        file->hashes = malloc(n_segments * sizeof(segment_digest));
+        file->replicas = calloc(n_segments, sizeof(int));
+        if (!file->hashes || !file->replicas) {
+            fprintf(stderr, "Failed to allocate hashes for file %s\n", name);
+            free(file->hashes);
+            free(file->replicas);
+            file->hashes = NULL;
+            file->replicas = NULL;
+            return -1;
+        }
+        memcpy(file->hashes, hashes, n_segments * sizeof(segment_digest));
+        file->n_segments = n_segments;
+    } else {
+        for (int k = 0; k < n_segments; k++) {
+            if (!digest_equal(&file->hashes[k], &hashes[k])) {
+                fprintf(stderr, "Hash mismatch for file %s, segment %d from sender %d\n",
+                        name, k, sender);
+                return -1;
+            }
+        }
+    }
+
+    // Sender-ul intră în swarm ca seed
+    SwarmMember* member = find_member(file, sender, 1);
+    if (!member) {
+        fprintf(stderr, "Failed to add sender %d to swarm of file %s\n", sender, name);
+        return -1;
+    }
+    grant_all_segments(file, member, NULL);
+
+    return 0;
+}
+
+// Procesează mesajul de înregistrare al unui client: numărul de fișiere,
+// apoi pentru fiecare antetul RegisteredFile și hash-urile segmentelor
+static int receive_registration(TrackerData* data, int sender, const char* buffer, int size) {
+    int n_files;
+    if (size < (int)sizeof(int)) {
+        return -1;
+    }
+    memcpy(&n_files, buffer, sizeof(int));
+
+    const char* end = buffer + size;
+    const char* cursor = buffer + sizeof(int);
+    int files_processed = 0;
+
+    for (int j = 0; j < n_files; j++) {
+        RegisteredFile entry;
+        if (end - cursor < (long)sizeof(entry)) {
+            break;
+        }
+        memcpy(&entry, cursor, sizeof(entry));
+        cursor += sizeof(entry);
+        entry.name[MAX_FILENAME - 1] = '\0';
+
+        if (entry.n_segments < 0 || end - cursor < (long)entry.n_segments * DIGEST_SIZE) {
+            break;
+        }
+        if (register_file(data, sender, entry.name, entry.n_segments,
+                          (const segment_digest*)cursor) == 0) {
+            files_processed++;
+        }
+        cursor += entry.n_segments * DIGEST_SIZE;
+    }
+
+    if (files_processed != n_files) {
+        fprintf(stderr, "Only %d/%d files successfully processed from sender %d\n",
+                files_processed, n_files, sender);
+        return -1;
+    }
+    return 0;
+}
+
+// Înregistrarea și semnalul de start folosesc operații colective pe
+// MPI_COMM_WORLD, câte una per shard și în ordinea shard-urilor, la care
+// participă toate rank-urile: fiecare client contribuie la MPI_Gatherv-ul
+// fiecărui tracker cu mesajul său de înregistrare (celelalte trackere cu un
+// mesaj gol), apoi fiecare tracker difuzează dicționarul său prin MPI_Bcast.
+// Rădăcina primește contribuțiile tuturor; celelalte rank-uri primesc NULL.
+static char* gather_registrations(int root, const char* buffer, int size, int* sizes, int* displs) {
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    CHECK_MPI(MPI_Gather(&size, 1, MPI_INT, sizes, 1, MPI_INT, root, MPI_COMM_WORLD));
+
+    char* gathered = NULL;
+    if (rank == root) {
+        int n_tasks;
+        long long total = 0;
+        MPI_Comm_size(MPI_COMM_WORLD, &n_tasks);
+        for (int i = 0; i < n_tasks; i++) {
+            displs[i] = (int)total;
+            total += sizes[i];
+        }
+        if (total > INT_MAX || !(gathered = malloc(total > 0 ? total : 1))) {
+            fprintf(stderr, "Failed to allocate %lld bytes of registrations\n", total);
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+    }
+
+    CHECK_MPI(MPI_Gatherv(buffer, size, MPI_BYTE, gathered, sizes, displs, MPI_BYTE, root,
+                          MPI_COMM_WORLD));
+    return gathered;
+}
+
+// Difuzează semnalul de start al shard-ului root; rădăcina îl dă în buffer,
+// celelalte rank-uri primesc o copie alocată
+static char* broadcast_start_signal(int root, char* buffer, int* size) {
+    CHECK_MPI(MPI_Bcast(size, 1, MPI_INT, root, MPI_COMM_WORLD));
+    if (!buffer && !(buffer = malloc(*size > 0 ? *size : 1))) {
+        fprintf(stderr, "Failed to allocate start signal\n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    CHECK_MPI(MPI_Bcast(buffer, *size, MPI_BYTE, root, MPI_COMM_WORLD));
+    return buffer;
+}
+
+// Primește înregistrările tuturor clienților pentru acest shard, participând
+// și la colectările celorlalte trackere
+void receive_initial_files(TrackerData* data) {
+    if (!data) {
+        fprintf(stderr, "Invalid tracker data pointer\n");
+        return;
+    }
+
+    int sizes[data->number_of_tasks];
+    int displs[data->number_of_tasks];
+    char* gathered = NULL;
+    for (int root = 0; root < n_trackers; root++) {
+        char* buffer = gather_registrations(root, NULL, 0, sizes, displs);
+        if (root == data->shard) {
+            gathered = buffer;
+        }
+    }
+
+    // Un client cu fișiere invalide participă totuși la schimb
+    int successful_receptions = 0;
+    for (int sender = n_trackers; sender < data->number_of_tasks; sender++) {
+        data->clients[sender] = CLIENT_ACTIVE;
+        metric_received(METRIC_REGISTRATION, sizes[sender]);
+        if (receive_registration(data, sender, gathered + displs[sender], sizes[sender]) == 0) {
+            successful_receptions++;
+        }
+    }
+    free(gathered);
+
+    fprintf(stderr, "Successfully received files from %d/%d clients\n",
+            successful_receptions, data->n_clients);
+}
+
+// Semnalul de start conține și dicționarul de fișiere al shard-ului: ID-ul
+// local al unui fișier este poziția numelui său în listă. Dicționarele
+// celorlalte shard-uri, primite la difuzările lor, nu sunt folosite.
+static void send_start_signal(TrackerData* data) {
+    int size = sizeof(StartHeader) + data->n_files * MAX_FILENAME;
+    char* buffer = calloc(1, size);
+    if (!buffer) {
+        fprintf(stderr, "Failed to allocate start signal\n");
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+
+    StartHeader header = {.signal = MSG_ACK, .n_files = data->n_files};
+    memcpy(buffer, &header, sizeof(header));
+    for (int id = 0; id < data->n_files; id++) {
+        strcpy(buffer + sizeof(StartHeader) + id * MAX_FILENAME, data->files[id].name);
+    }
+
+    metric_sent(METRIC_START, size);
+    for (int root = 0; root < n_trackers; root++) {
+        int root_size = size;
+        char* received = broadcast_start_signal(root, root == data->shard ? buffer : NULL, &root_size);
+        if (received != buffer) {
+            free(received);
+        }
+    }
+    free(buffer);
+}
+
+// Membrii care pot fi trimiși ca peers: alții decât sender-ul, cu cel puțin un segment
+static inline int is_listed_peer(const TrackerFile* file, const SwarmMember* member, int sender) {
+    return member->rank != sender && !bitmap_empty(member->bits, BITMAP_WORDS(file->n_segments));
+}
+
+// Construiește răspunsul împachetat cu lista de peers pentru un fișier:
+// antet, bitset-urile peer-ilor, rank-urile lor, replicile și tabela canonică de hash-uri
+static void *pack_peer_list(TrackerData* data, int file_id, int sender, int* size) {
+    TrackerFile* file = &data->files[file_id];
+    int words = BITMAP_WORDS(file->n_segments);
+    PeerListHeader header = {.n_segments = file->n_segments};
+
+    for (int i = 0; i < file->n_members; i++) {
+        if (is_listed_peer(file, &file->members[i], sender)) {
+            header.n_peers++;
+        }
+    }
+
+    *size = peer_list_size(header.n_segments, header.n_peers);
+    char* buffer = malloc(*size);
+    if (!buffer) {
+        return NULL;
+    }
+    memcpy(buffer, &header, sizeof(header));
+
+    uint64_t* bits = (uint64_t*)(buffer + sizeof(PeerListHeader));
+    int* peers = (int*)(bits + header.n_peers * words);
+    for (int i = 0; i < file->n_members; i++) {
+        const SwarmMember* member = &file->members[i];
+        if (is_listed_peer(file, member, sender)) {
+            memcpy(bits, member->bits, words * sizeof(uint64_t));
+            *peers++ = member->rank;
+            bits += words;
+        }
+    }
+    memcpy(peers, file->replicas, header.n_segments * sizeof(int));
+    memcpy(peers + header.n_segments, file->hashes, header.n_segments * sizeof(segment_digest));
+
+    return buffer;
+}
+
+// Mesajele tracker-ului către clienți sunt trimise neblocant, și din workeri
+// în modul paralel; buffer-ul se eliberează după ce trimiterea s-a încheiat
+static void queue_send(TrackerData* data, int dest, int tag, void* buffer, int size, int owned) {
+    SendShard* shard = &data->sends[dest % TRACKER_SEND_SHARDS];
+    pthread_mutex_lock(&shard->lock);
+    if (shard->n_sends == shard->capacity) {
+        int capacity = shard->capacity ? shard->capacity * 2 : 16;
+        PendingSend* sends = realloc(shard->sends, capacity * sizeof(PendingSend));
+        if (!sends) {
+            fprintf(stderr, "Failed to queue reply to %d\n", dest);
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+        shard->sends = sends;
+        shard->capacity = capacity;
+    }
+
+    PendingSend* send = &shard->sends[shard->n_sends++];
+    send->buffer = owned ? buffer : NULL;
+    CHECK_MPI(MPI_Isend(buffer, size, MPI_BYTE, dest, tag, MPI_COMM_WORLD, &send->request));
+    pthread_mutex_unlock(&shard->lock);
+    metric_sent(tag == TAG_AVAILABILITY ? METRIC_AVAILABILITY : METRIC_PEER_LIST, size);
+}
+
+// Eliberează trimiterile încheiate; cu wait, le așteaptă pe toate
+static void complete_replies(TrackerData* data, int wait) {
+    for (int s = 0; s < TRACKER_SEND_SHARDS; s++) {
+        SendShard* shard = &data->sends[s];
+        pthread_mutex_lock(&shard->lock);
+        int kept = 0;
+        for (int i = 0; i < shard->n_sends; i++) {
+            int done = 1;
+            if (wait) {
+                CHECK_MPI(MPI_Wait(&shard->sends[i].request, MPI_STATUS_IGNORE));
+            } else {
+                CHECK_MPI(MPI_Test(&shard->sends[i].request, &done, MPI_STATUS_IGNORE));
+            }
+
+            if (done) {
+                free(shard->sends[i].buffer);
+            } else {
+                shard->sends[kept++] = shard->sends[i];
+            }
+        }
+        shard->n_sends = kept;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+// Lock-ul listei de abonați a fișierului. Abonările se fac și sub lock-ul de
+// citire al fișierului, deci în modul paralel lista are lock-ul ei; fără
+// workeri, doar bucla de evenimente o modifică.
+static void lock_subscribers(TrackerData* data, const TrackerFile* file);
+static void unlock_subscribers(TrackerData* data, const TrackerFile* file);
+
+// Abonează clientul la schimbările de disponibilitate ale fișierului
+static void subscribe(TrackerData* data, TrackerFile* file, int rank) {
+    lock_subscribers(data, file);
+    int found = 0;
+    for (int i = 0; i < file->n_subscribers && !found; i++) {
+        found = file->subscribers[i] == rank;
+    }
+
+    if (!found && file->n_subscribers == file->subscribers_capacity) {
+        int capacity = file->subscribers_capacity ? file->subscribers_capacity * 2 : 4;
+        int* subscribers = realloc(file->subscribers, capacity * sizeof(int));
+        if (subscribers) {
+            file->subscribers = subscribers;
+            file->subscribers_capacity = capacity;
+        }
+    }
+    if (!found && file->n_subscribers < file->subscribers_capacity) {
+        file->subscribers[file->n_subscribers++] = rank;
+    } else if (!found) {
+        fprintf(stderr, "Failed to subscribe %d to file %s\n", rank, file->name);
+    }
+    unlock_subscribers(data, file);
+}
+
+// Dezabonează clientul, dacă era abonat
+static void unsubscribe(TrackerData* data, TrackerFile* file, int rank) {
+    lock_subscribers(data, file);
+    for (int i = 0; i < file->n_subscribers; i++) {
+        if (file->subscribers[i] == rank) {
+            file->subscribers[i] = file->subscribers[--file->n_subscribers];
+            break;
+        }
+    }
+    unlock_subscribers(data, file);
+}
+
+// Trimite abonaților (în afară de rank) segmentele pe care rank le deține de acum
+static void push_availability(TrackerData* data, int local, int rank, const int* segments, int n) {
+    TrackerFile* file = &data->files[local];
+    AvailabilityHeader header = {.file_id = local * n_trackers + data->shard, .rank = rank,
+                                 .n_segments = n};
+    int size = sizeof(header) + n * sizeof(int);
+
+    lock_subscribers(data, file);
+    for (int i = 0; i < file->n_subscribers; i++) {
+        if (file->subscribers[i] == rank) {
+            continue;
+        }
+
+        char* buffer = malloc(size);
+        if (!buffer) {
+            fprintf(stderr, "Failed to allocate availability push for file %s\n", file->name);
+            break;
+        }
+        memcpy(buffer, &header, sizeof(header));
+        memcpy(buffer + sizeof(header), segments, n * sizeof(int));
+        queue_send(data, file->subscribers[i], TAG_AVAILABILITY, buffer, size, 1);
+    }
+    unlock_subscribers(data, file);
+}
+
+// Procesare cerere segment
+void handle_segment_request1(TrackerData* data, int sender, const TrackerRequest* request) {
+    static const PeerListHeader empty = {0};
+    int size;
+
+    // Pentru un fișier necunoscut răspunsul rămâne antetul gol. Nicio
+    // actualizare nu rulează între construirea listei și abonare, deci
+    // clientul nu pierde nicio schimbare.
+    int local = local_file_id(data, request->file_id, sender);
+    void* buffer = local >= 0 ? pack_peer_list(data, local, sender, &size) : NULL;
+    if (buffer) {
+        subscribe(data, &data->files[local], sender);
+        queue_send(data, sender, 0, buffer, size, 1);
+        return;
+    }
+    if (local >= 0) {
+        fprintf(stderr, "Failed to allocate peer list for file %d\n", request->file_id);
+    }
+
+    // Clientul trebuie să primească mereu un răspuns
+    queue_send(data, sender, 0, (void*)&empty, sizeof(empty), 0);
+}
+
+
+// Procesare actualizare de la client: un singur mesaj cu segmentele noi;
+// aplicarea este idempotentă, iar mesajele vechi sau duplicate sunt ignorate
+void handle_update(TrackerData* data, int sender, const UpdateHeader* header, int size) {
+    const int* segment_ids = (const int*)(header + 1);
+
+    int local;
+    if (size != (int)(sizeof(UpdateHeader) + header->n_segments * sizeof(int)) ||
+        (local = local_file_id(data, header->file_id, sender)) < 0) {
+        fprintf(stderr, "Invalid update from sender %d\n", sender);
+        return;
+    }
+
+    TrackerFile* file = &data->files[local];
+    SwarmMember* member = find_member(file, sender, 1);
+    if (!member) {
+        fprintf(stderr, "Failed to add sender %d to swarm of file %d\n", sender, header->file_id);
+        return;
+    }
+
+    if (header->seq <= member->update_seq) {
+        fprintf(stderr, "Stale update %d (last %d) for file %d from sender %d\n",
+                header->seq, member->update_seq, header->file_id, sender);
+        return;
+    }
+    member->update_seq = header->seq;
+
+    if (header->n_segments == 0) {
+        return;
+    }
+
+    // Abonații primesc doar segmentele care chiar sunt noi pentru sender
+    int* added = malloc(header->n_segments * sizeof(int));
+    int n_added = 0;
+
+    for (int i = 0; i < header->n_segments; i++) {
+        if (segment_ids[i] < 0 || segment_ids[i] >= file->n_segments) {
+            fprintf(stderr, "Invalid update: file_id=%d, segment_id=%d\n",
+                    header->file_id, segment_ids[i]);
+            continue;
+        }
+        if (grant_segment(file, member, segment_ids[i]) && added) {
+            added[n_added++] = segment_ids[i];
+        }
+    }
+
+    if (n_added > 0) {
+        push_availability(data, local, sender, added, n_added);
+    }
+    free(added);
+}
+
+// Încheie abonarea clientului la fișier (MSG_CANCEL sau după MSG_FINISH).
+// Mesajul de sfârșit pleacă și dacă cererea listei nu ajunsese să-l aboneze,
+// clientul așteptându-l pentru fiecare fișier început. Un fișier fără stare
+// la tracker apare aici doar după un eșec la înregistrare sau la alocare;
+// clientul primește și atunci mesajul de sfârșit.
+static void end_subscription(TrackerData* data, int sender, const TrackerRequest* request) {
+    int local = request->file_id / n_trackers;
+    if (request->file_id < 0 || tracker_for_file(request->file_id) != data->shard) {
+        fprintf(stderr, "Invalid file_id %d from sender %d\n", request->file_id, sender);
+        return;
+    }
+    if (local < data->n_files && data->files[local].n_segments > 0) {
+        unsubscribe(data, &data->files[local], sender);
+    }
+
+    AvailabilityHeader* end = malloc(sizeof(AvailabilityHeader));
+    if (!end) {
+        fprintf(stderr, "Failed to allocate end of subscription for %d\n", sender);
+        return;
+    }
+    end->file_id = request->file_id;
+    end->rank = sender;
+    end->n_segments = AVAILABILITY_END;
+    queue_send(data, sender, TAG_AVAILABILITY, end, sizeof(*end), 1);
+}
+
+// Promovare în seed: toate segmentele devin deținute, iar abonarea clientului
+// la fișier se încheie
+static void handle_finish(TrackerData* data, int sender, const TrackerRequest* request) {
+    int local = local_file_id(data, request->file_id, sender);
+    TrackerFile* file = local >= 0 ? &data->files[local] : NULL;
+    SwarmMember* member = file ? find_member(file, sender, 1) : NULL;
+    if (member) {
+        // Fișierele cu stare au cel puțin un segment
+        int* added = malloc(file->n_segments * sizeof(int));
+        int n_added = grant_all_segments(file, member, added);
+
+        if (added && n_added > 0) {
+            push_availability(data, local, sender, added, n_added);
+        }
+        free(added);
+    }
+
+    end_subscription(data, sender, request);
+}
+
+// Procesează un mesaj deja validat de bucla de evenimente
+static void process_message(TrackerData* data, int sender, const int* buffer, int size) {
+    double started = metrics_path ? MPI_Wtime() : 0;
+    double traced = trace_begin();
+
+    switch (buffer[0]) {
+        case MSG_REQUEST:
+            handle_segment_request1(data, sender, (const TrackerRequest*)buffer);
+            break;
+
+        case MSG_FINISH:
+            handle_finish(data, sender, (const TrackerRequest*)buffer);
+            break;
+
+        case MSG_CANCEL:
+            end_subscription(data, sender, (const TrackerRequest*)buffer);
+            break;
+
+        case MSG_UPDATE:
+            handle_update(data, sender, (const UpdateHeader*)buffer, size);
+            break;
+    }
+
+    if (metrics_path) {
+        metric_observe(HISTOGRAM_TRACKER_SERVICE, (MPI_Wtime() - started) * 1e6);
+    }
+    trace_end(buffer[0] == MSG_REQUEST  ? "tracker peer list"
+              : buffer[0] == MSG_FINISH ? "tracker finish"
+              : buffer[0] == MSG_CANCEL ? "tracker cancel"
+                                        : "tracker update",
+              traced, "sender", sender);
+}
+
+// Modul paralel al tracker-ului: bucla de evenimente doar demultiplexează
+// mesajele, iar un grup de workeri le procesează. Cererile de liste de peers
+// pot rula oricând în paralel (lock de citire pe fișier); actualizările și
+// finalizările unui fișier intră în coada lui și sunt aplicate, în ordinea
+// sosirii, de un singur worker o dată (lock de scriere), deci fișiere diferite
+// se actualizează în paralel.
+typedef struct TrackerJob {
+    struct TrackerJob* next;
+    int file;                          // ID-ul local al fișierului
+    int sender;
+    int size;
+    int message[];                     // Copia mesajului primit
+} TrackerJob;
+
+typedef struct {
+    pthread_rwlock_t lock;             // Protejează starea fișierului din TrackerData
+    pthread_mutex_t subscribers_lock;  // Lista de abonați, modificată și sub lock-ul de citire
+    pthread_mutex_t queue_lock;
+    TrackerJob* head;                  // Actualizări în așteptare
+    TrackerJob* tail;
+    int scheduled;                     // În coada de fișiere gata sau la un worker
+} FileWork;
+
+typedef struct TrackerPool {
+    TrackerData* data;
+    FileWork* files;                   // [ID local]
+    pthread_t* threads;
+    int n_workers;
+    pthread_mutex_t lock;              // Protejează cozile de mai jos
+    pthread_cond_t ready;
+    TrackerJob* reads_head;            // Cereri de liste de peers
+    TrackerJob* reads_tail;
+    int* ready_files;                  // Coadă circulară de fișiere cu actualizări
+    int ready_first;
+    int ready_count;
+    int stopping;
+} TrackerPool;
+
+static void lock_subscribers(TrackerData* data, const TrackerFile* file) {
+    if (data->pool) {
+        pthread_mutex_lock(&data->pool->files[file - data->files].subscribers_lock);
+    }
+}
+
+static void unlock_subscribers(TrackerData* data, const TrackerFile* file) {
+    if (data->pool) {
+        pthread_mutex_unlock(&data->pool->files[file - data->files].subscribers_lock);
+    }
+}
+
+static TrackerJob* make_job(int file, int sender, const int* buffer, int size) {
+    TrackerJob* job = malloc(sizeof(TrackerJob) + size);
+    if (!job) {
+        fprintf(stderr, "Failed to allocate tracker job from sender %d\n", sender);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+    job->next = NULL;
+    job->file = file;
+    job->sender = sender;
+    job->size = size;
+    memcpy(job->message, buffer, size);
+    return job;
+}
+
+// Apelat cu pool->lock luat
+static void push_ready_file(TrackerPool* pool, int file) {
+    int n_files = pool->data->n_files;
+    pool->ready_files[(pool->ready_first + pool->ready_count++) % n_files] = file;
+    pthread_cond_signal(&pool->ready);
+}
+
+// Aplică actualizările în așteptare ale unui fișier; după TRACKER_DRAIN_BATCH
+// mesaje fișierul revine la coadă, ca un fișier foarte activ să nu țină
+// un worker ocupat la nesfârșit
+static void drain_file(TrackerPool* pool, int file) {
+    FileWork* work = &pool->files[file];
+
+    for (int processed = 0;; processed++) {
+        pthread_mutex_lock(&work->queue_lock);
+        TrackerJob* job = work->head;
+        if (!job || processed == TRACKER_DRAIN_BATCH) {
+            if (!job) {
+                work->scheduled = 0;
+            }
+            pthread_mutex_unlock(&work->queue_lock);
+
+            if (job) {
+                pthread_mutex_lock(&pool->lock);
+                push_ready_file(pool, file);
+                pthread_mutex_unlock(&pool->lock);
+            }
+            return;
+        }
+        work->head = job->next;
+        if (!work->head) {
+            work->tail = NULL;
+        }
+        pthread_mutex_unlock(&work->queue_lock);
+
+        pthread_rwlock_wrlock(&work->lock);
+        process_message(pool->data, job->sender, job->message, job->size);
+        pthread_rwlock_unlock(&work->lock);
+        free(job);
+    }
+}
+
+static void *tracker_worker_func(void *arg) {
+    TrackerPool* pool = arg;
+    trace_thread("tracker worker");
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->ready_count && !pool->reads_head && !pool->stopping) {
+            pthread_cond_wait(&pool->ready, &pool->lock);
+        }
+
+        if (pool->ready_count) {
+            int file = pool->ready_files[pool->ready_first];
+            pool->ready_first = (pool->ready_first + 1) % pool->data->n_files;
+            pool->ready_count--;
+            pthread_mutex_unlock(&pool->lock);
+
+            drain_file(pool, file);
+        } else if (pool->reads_head) {
+            TrackerJob* job = pool->reads_head;
+            pool->reads_head = job->next;
+            if (!pool->reads_head) {
+                pool->reads_tail = NULL;
+            }
+            pthread_mutex_unlock(&pool->lock);
+
+            FileWork* work = &pool->files[job->file];
+            pthread_rwlock_rdlock(&work->lock);
+            process_message(pool->data, job->sender, job->message, job->size);
+            pthread_rwlock_unlock(&work->lock);
+            free(job);
+        } else {
+            pthread_mutex_unlock(&pool->lock);
+            break;  // Oprire, cu toate cozile golite
+        }
+    }
+
+    return NULL;
+}
+
+// Pornește workerii; fișierele sunt deja înregistrate, deci numărul lor nu mai crește
+static TrackerPool* start_tracker_pool(TrackerData* data, int n_workers) {
+    TrackerPool* pool = calloc(1, sizeof(TrackerPool));
+    if (!pool) {
+        return NULL;
+    }
+    pool->data = data;
+    pool->n_workers = n_workers;
+    pool->files = calloc(data->n_files > 0 ? data->n_files : 1, sizeof(FileWork));
+    pool->ready_files = calloc(data->n_files > 0 ? data->n_files : 1, sizeof(int));
+    pool->threads = calloc(n_workers, sizeof(pthread_t));
+    if (!pool->files || !pool->ready_files || !pool->threads) {
+        free(pool->files);
+        free(pool->ready_files);
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+
+    for (int i = 0; i < data->n_files; i++) {
+        pthread_rwlock_init(&pool->files[i].lock, NULL);
+        pthread_mutex_init(&pool->files[i].subscribers_lock, NULL);
+        pthread_mutex_init(&pool->files[i].queue_lock, NULL);
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->ready, NULL);
+
+    for (int i = 0; i < n_workers; i++) {
+        if (pthread_create(&pool->threads[i], NULL, tracker_worker_func, pool) != 0) {
+            fprintf(stderr, "Failed to start tracker worker %d\n", i);
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+    }
+
+    data->pool = pool;
+    return pool;
+}
+
+// Workerii termină ce au în cozi și se opresc
+static void stop_tracker_pool(TrackerPool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->n_workers; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    for (int i = 0; i < pool->data->n_files; i++) {
+        pthread_rwlock_destroy(&pool->files[i].lock);
+        pthread_mutex_destroy(&pool->files[i].subscribers_lock);
+        pthread_mutex_destroy(&pool->files[i].queue_lock);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->ready);
+
+    pool->data->pool = NULL;
+    free(pool->files);
+    free(pool->ready_files);
+    free(pool->threads);
+    free(pool);
+}
+
+// Trimite mesajul validat către coada potrivită
+static void submit_message(TrackerPool* pool, int sender, const int* buffer, int size) {
+    const TrackerRequest* request = (const TrackerRequest*)buffer;
+    int local = local_file_id(pool->data, request->file_id, sender);
+
+    if (local < 0) {
+        // Cererea tot primește răspunsul gol, iar MSG_CANCEL/MSG_FINISH mesajul
+        // de sfârșit, ca în modul fără workeri; actualizările se ignoră
+        if (buffer[0] != MSG_UPDATE) {
+            process_message(pool->data, sender, buffer, size);
+        }
+        return;
+    }
+
+    TrackerJob* job = make_job(local, sender, buffer, size);
+    if (buffer[0] == MSG_REQUEST) {
+        pthread_mutex_lock(&pool->lock);
+        if (pool->reads_tail) {
+            pool->reads_tail->next = job;
+        } else {
+            pool->reads_head = job;
+        }
+        pool->reads_tail = job;
+        pthread_cond_signal(&pool->ready);
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
+
+    FileWork* work = &pool->files[local];
+    pthread_mutex_lock(&work->queue_lock);
+    if (work->tail) {
+        work->tail->next = job;
+    } else {
+        work->head = job;
+    }
+    work->tail = job;
+    int schedule = !work->scheduled;
+    work->scheduled = 1;
+    pthread_mutex_unlock(&work->queue_lock);
+
+    if (schedule) {
+        pthread_mutex_lock(&pool->lock);
+        push_ready_file(pool, local);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+// Validează un mesaj primit de la un client și îl procesează, direct sau prin workeri
+static void dispatch_message(TrackerData* data, int sender, const int* buffer, int size) {
+    if (size < (int)sizeof(int) || sender < n_trackers || data->clients[sender] != CLIENT_ACTIVE) {
+        fprintf(stderr, "Unexpected message from sender %d\n", sender);
+        return;
+    }
+
+    switch (buffer[0]) {
+        case MSG_REQUEST:
+        case MSG_FINISH:
+        case MSG_CANCEL:
+            if (size != (int)sizeof(TrackerRequest)) {
+                fprintf(stderr, "Invalid message size %d from sender %d\n", size, sender);
+                return;
+            }
+            break;
+
+        case MSG_UPDATE:
+            if (size < (int)sizeof(UpdateHeader)) {
+                fprintf(stderr, "Invalid update from sender %d\n", sender);
+                return;
+            }
+            break;
+
+        default:
+            fprintf(stderr, "Unknown signal (%d) from sender %d\n", buffer[0], sender);
+            return;
+    }
+
+    metric_received(buffer[0] == MSG_REQUEST  ? METRIC_PEER_LIST_REQUEST
+                    : buffer[0] == MSG_UPDATE ? METRIC_UPDATE
+                    : buffer[0] == MSG_FINISH ? METRIC_FINISH
+                                              : METRIC_CANCEL,
+                    size);
+
+    if (data->pool) {
+        submit_message(data->pool, sender, buffer, size);
+    } else {
+        process_message(data, sender, buffer, size);
+    }
+}
+
+// Eliberare memorie
+void cleanup_tracker(TrackerData* data) {
+    if (!data) return;
+
+    for (int i = 0; i < data->n_files; i++) {
+        TrackerFile* file = &data->files[i];
+        for (int m = 0; m < file->n_members; m++) {
+            free(file->members[m].bits);
+        }
+        free(file->members);
+        free(file->subscribers);
+        free(file->hashes);
+        free(file->replicas);
+    }
+    free(data->files);
+    free(data->names);
+    free(data->clients);
+    for (int i = 0; i < TRACKER_SEND_SHARDS; i++) {
+        free(data->sends[i].sends);
+        pthread_mutex_destroy(&data->sends[i].lock);
+    }
+
+    free(data);
+}
+
+// Recepție încheiată într-un apel MPI_Waitsome
+typedef struct {
+    int index;                         // Recepția persistentă
+    int status;                        // Poziția în vectorul de stări
+    long posted;                       // Ordinea postării
+} CompletedReceive;
+
+static int compare_completed(const void* a, const void* b) {
+    const CompletedReceive* x = a;
+    const CompletedReceive* y = b;
+    return (x->posted > y->posted) - (x->posted < y->posted);
+}
+
+void tracker(int number_of_tasks, int rank, int n_workers) {
+    // Inițializare tracker
+    TrackerData* data = init_tracker(number_of_tasks, rank);
+    if (!data) {
+        fprintf(stderr, "Failed to initialize tracker\n");
+        return;
+    }
+
+    // Primire fișiere inițiale
+    receive_initial_files(data);
+
+    // Trimite semnal de start, împreună cu dicționarul de fișiere, către toți clienții
+    send_start_signal(data);
+
+    TrackerPool* pool = NULL;
+    if (n_workers > 0 && !(pool = start_tracker_pool(data, n_workers))) {
+        fprintf(stderr, "Failed to start tracker workers, processing messages inline\n");
+    }
+
+    // Bucla de evenimente: TRACKER_RECEIVES recepții persistente, plus bariera
+    // de terminare, care se încheie când toți clienții au terminat descărcările.
+    // Fiecare mesaj este complet, deci niciun client nu îi blochează pe ceilalți.
+    static int buffers[TRACKER_RECEIVES][TRACKER_MESSAGE_SIZE / sizeof(int)];
+    MPI_Request requests[TRACKER_RECEIVES + 1];
+    long posted[TRACKER_RECEIVES];
+    long next_post = 0;
+
+    for (int i = 0; i < TRACKER_RECEIVES; i++) {
+        CHECK_MPI(MPI_Recv_init(buffers[i], TRACKER_MESSAGE_SIZE, MPI_BYTE, MPI_ANY_SOURCE, 1,
+                                MPI_COMM_WORLD, &requests[i]));
+        CHECK_MPI(MPI_Start(&requests[i]));
+        posted[i] = next_post++;
+    }
+    CHECK_MPI(MPI_Ibarrier(termination_comm, &requests[TRACKER_RECEIVES]));
+
+    int indices[TRACKER_RECEIVES + 1];
+    MPI_Status statuses[TRACKER_RECEIVES + 1];
+    CompletedReceive completed[TRACKER_RECEIVES];
+    int terminated = 0;
+
+    while (!terminated) {
+        int outcount;
+        CHECK_MPI(MPI_Waitsome(TRACKER_RECEIVES + 1, requests, &outcount, indices, statuses));
+
+        // Mesajele aceluiași client se potrivesc cu recepțiile în ordinea
+        // postării lor, deci în această ordine se și procesează
+        int n_completed = 0;
+        for (int k = 0; k < outcount; k++) {
+            if (indices[k] == TRACKER_RECEIVES) {
+                terminated = 1;
+                continue;
+            }
+            completed[n_completed++] = (CompletedReceive){.index = indices[k], .status = k,
+                                                          .posted = posted[indices[k]]};
+        }
+        qsort(completed, n_completed, sizeof(CompletedReceive), compare_completed);
+
+        for (int k = 0; k < n_completed; k++) {
+            int i = completed[k].index;
+            MPI_Status* status = &statuses[completed[k].status];
+
+            int size;
+            CHECK_MPI(MPI_Get_count(status, MPI_BYTE, &size));
+            dispatch_message(data, status->MPI_SOURCE, buffers[i], size);
+
+            CHECK_MPI(MPI_Start(&requests[i]));
+            posted[i] = next_post++;
+        }
+
+        complete_replies(data, 0);
+    }
+
+    // Clienții își opresc singuri thread-urile de upload după barieră
+    for (int i = 0; i < TRACKER_RECEIVES; i++) {
+        CHECK_MPI(MPI_Cancel(&requests[i]));
+        CHECK_MPI(MPI_Wait(&requests[i], MPI_STATUS_IGNORE));
+        CHECK_MPI(MPI_Request_free(&requests[i]));
+    }
+    if (pool) {
+        stop_tracker_pool(pool);
+    }
+    complete_replies(data, 1);
+
+    cleanup_tracker(data);
+}
+
+// Index al segmentelor deținute, după hash, folosit de thread-ul de upload.
+// Tabelă cu adresare deschisă (sondare liniară) care crește la încărcare 1/2;
+// thread-ul de download adaugă segmentele pe măsură ce le obține. Lock-ul
+// protejează și scrierile în users_files citite de thread-ul de upload.
+typedef struct {
+    uint64_t key;                      // 0 = slot liber
+    int file_id;
+    int segment_id;
+} SegmentIndexEntry;
+
+typedef struct {
+    SegmentIndexEntry* entries;
+    int capacity;                      // Putere a lui 2
+    int count;
+    pthread_rwlock_t lock;
+} SegmentIndex;
+
+SegmentIndex segment_index = {.lock = PTHREAD_RWLOCK_INITIALIZER};
+
+// Hash-urile MD5 sunt deja uniform distribuite: primii 8 octeți ajung drept cheie
+static uint64_t segment_key(const segment_digest* hash) {
+    uint64_t key;
+    memcpy(&key, hash->bytes, sizeof(key));
+    return key ? key : 1;
+}
+
+// Caută slotul pentru hash: fie cel care îl conține, fie primul slot liber
+static SegmentIndexEntry* segment_index_slot(SegmentIndexEntry* entries, int capacity,
+                                             uint64_t key, const segment_digest* hash) {
+    for (int i = key & (capacity - 1);; i = (i + 1) & (capacity - 1)) {
+        SegmentIndexEntry* entry = &entries[i];
+        if (entry->key == 0) {
+            return entry;
+        }
+        if (entry->key == key && hash &&
+            digest_equal(&users_files[entry->file_id].segments[entry->segment_id], hash)) {
+            return entry;
+        }
+    }
+}
+
+static int segment_index_grow(void) {
+    int capacity = segment_index.capacity ? segment_index.capacity * 2 : 256;
+    SegmentIndexEntry* entries = calloc(capacity, sizeof(SegmentIndexEntry));
+    if (!entries) {
+        return -1;
+    }
+
+    // Cheile sunt unice, deci reinserarea nu are nevoie de comparații de hash
+    for (int i = 0; i < segment_index.capacity; i++) {
+        if (segment_index.entries[i].key) {
+            *segment_index_slot(entries, capacity, segment_index.entries[i].key, NULL) =
+                segment_index.entries[i];
+        }
+    }
+
+    free(segment_index.entries);
+    segment_index.entries = entries;
+    segment_index.capacity = capacity;
+    return 0;
+}
+
+// Marchează un segment ca deținut: hash-ul intră în users_files și în index
+void add_owned_segment(int file_id, int segment_id, const segment_digest* hash) {
+    uint64_t key = segment_key(hash);
+
+    pthread_rwlock_wrlock(&segment_index.lock);
+    users_files[file_id].segments[segment_id] = *hash;
+    bitmap_set(users_files[file_id].present, segment_id);
+
+    if (2 * (segment_index.count + 1) > segment_index.capacity && segment_index_grow() < 0) {
+        fprintf(stderr, "Failed to grow segment index\n");
+        pthread_rwlock_unlock(&segment_index.lock);
+        return;
+    }
+
+    SegmentIndexEntry* entry = segment_index_slot(segment_index.entries,
+                                                  segment_index.capacity, key, hash);
+    if (entry->key == 0) {
+        entry->key = key;
+        entry->file_id = file_id;
+        entry->segment_id = segment_id;
+        segment_index.count++;
+    }
+    pthread_rwlock_unlock(&segment_index.lock);
+}
+
+// Caută segmentul cu hash-ul dat; întoarce 1 și poziția lui dacă e deținut
+int segment_index_find(const segment_digest* hash, int* file_id, int* segment_id) {
+    uint64_t key = segment_key(hash);
+    int found = 0;
+
+    pthread_rwlock_rdlock(&segment_index.lock);
+    if (segment_index.capacity > 0) {
+        SegmentIndexEntry* entry = segment_index_slot(segment_index.entries,
+                                                      segment_index.capacity, key, hash);
+        if (entry->key != 0) {
+            *file_id = entry->file_id;
+            *segment_id = entry->segment_id;
+            found = 1;
+        }
+    }
+    pthread_rwlock_unlock(&segment_index.lock);
+
+    return found;
+}
+
+// Alocă tabelele unui fișier descărcat, dimensionate după lista de peers
+static int reserve_file_storage(int file_id, int n_segments) {
+    file_info* file = &users_files[file_id];
+    if (file->segments) {
+        return file->n_segments == n_segments ? 0 : -1;
+    }
+
+    segment_digest* segments = calloc(n_segments, sizeof(segment_digest));
+    uint64_t* present = calloc(BITMAP_WORDS(n_segments), sizeof(uint64_t));
+    uint64_t* advertised = calloc(BITMAP_WORDS(n_segments), sizeof(uint64_t));
+    if (!segments || !present || !advertised) {
+        fprintf(stderr, "Failed to allocate memory for segments of file %s\n", file->name);
+        free(segments);
+        free(present);
+        free(advertised);
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&segment_index.lock);
+    file->segments = segments;
+    file->present = present;
+    file->advertised = advertised;
+    file->n_segments = n_segments;
+    pthread_rwlock_unlock(&segment_index.lock);
+    return 0;
+}
+
+void segment_index_destroy(void) {
+    free(segment_index.entries);
+    segment_index.entries = NULL;
+    segment_index.capacity = 0;
+    segment_index.count = 0;
+}
+
+// Depozitul de segmente: conținutul fiecărui fișier stă într-un fișier mapat
+// în memorie, segmentul k la offset-ul k * segment_size. Seed-urile mapează
+// doar pentru citire <dir>/<nume>, iar fișierele descărcate sunt create ca
+// <dir>/client<rank>_<nume>.data, lângă lista de hash-uri. Uploader-ul
+// trimite direct din mapare, iar downloader-ul primește direct la offset-ul
+// segmentului. Dezactivat (dir NULL) dacă TEMA2_PIECE_DIR nu e setată: atunci
+// se schimbă doar confirmări.
+typedef struct {
+    char* data;                        // Maparea fișierului sau NULL
+    size_t size;
+} PieceMap;
+
+typedef struct {
+    const char* dir;
+    int segment_size;
+    PieceMap* maps;                    // [ID global]
+    int n_maps;
+} PieceStore;
+
+PieceStore piece_store;
+
+static inline char* piece_address(int file_id, int segment_id) {
+    char* data = piece_store.maps[file_id].data;
+    return data ? data + (size_t)segment_id * piece_store.segment_size : NULL;
+}
+
+static int piece_map(int file_id, const char* path, int n_segments, int writable) {
+    size_t size = (size_t)n_segments * piece_store.segment_size;
+    int fd = open(path, writable ? O_RDWR | O_CREAT | O_TRUNC : O_RDONLY, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open piece file %s\n", path);
+        return -1;
+    }
+
+    struct stat info;
+    if ((writable && ftruncate(fd, size) < 0) ||
+        (!writable && (fstat(fd, &info) < 0 || (size_t)info.st_size < size))) {
+        fprintf(stderr, "Piece file %s is shorter than %d segments\n", path, n_segments);
+        close(fd);
+        return -1;
+    }
+
+    char* data = size ? mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                             MAP_SHARED, fd, 0)
+                      : NULL;
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Failed to map piece file %s\n", path);
+        return -1;
+    }
+
+    piece_store.maps[file_id].data = data;
+    piece_store.maps[file_id].size = size;
+    return 0;
+}
+
+// Mapează fișierele deținute la pornire; un seed fără date nu le poate servi
+static void piece_store_init(const char* dir, int segment_size) {
+    if (!dir || !*dir) {
+        return;
+    }
+    piece_store.maps = calloc(n_known_files, sizeof(PieceMap));
+    if (!piece_store.maps) {
+        fprintf(stderr, "Failed to allocate piece store\n");
+        return;
+    }
+    piece_store.dir = dir;
+    piece_store.segment_size = segment_size;
+    piece_store.n_maps = n_known_files;
+
+    for (int i = 0; i < n_known_files; i++) {
+        if (users_files[i].segments) {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", dir, users_files[i].name);
+            piece_map(i, path, users_files[i].n_segments, 0);
+        }
+    }
+}
+
+// Creează fișierul în care se primesc segmentele descărcate
+static int piece_store_create(int rank, int file_id, int n_segments) {
+    if (!piece_store.dir || piece_store.maps[file_id].data) {
+        return 0;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/client%d_%s.data", piece_store.dir, rank,
+             users_files[file_id].name);
+    return piece_map(file_id, path, n_segments, 1);
+}
+
+static void piece_store_destroy(void) {
+    for (int i = 0; i < piece_store.n_maps; i++) {
+        if (piece_store.maps[i].data) {
+            munmap(piece_store.maps[i].data, piece_store.maps[i].size);
+        }
+    }
+    free(piece_store.maps);
+    piece_store.maps = NULL;
+    piece_store.n_maps = 0;
+}
+
+// receives list from the tracker with all peers/seeds from which
+// the client can request a segment; the hashes stay in the received
+// buffer, while the availability map is copied so that the tracker's
+// pushes can update it in place
+typedef struct PeerList {
+    void* buffer;                      // Mesajul primit de la tracker
+    const PeerListHeader* header;
+    const segment_digest* hashes;      // Tabela canonică din buffer
+    int* replicas;                     // Numărul de replici per segment
+    int number_of_tasks;
+    uint64_t** bits;                   // [peer] -> bitset-ul peer-ului sau NULL
+} PeerList;
+
+void free_peer_list(PeerList* peer_list) {
+    if (!peer_list) return;
+
+    if (peer_list->bits) {
+        for (int p = 0; p < peer_list->number_of_tasks; p++) {
+            free(peer_list->bits[p]);
+        }
+    }
+    free(peer_list->bits);
+    free(peer_list->replicas);
+    free(peer_list->buffer);
+    free(peer_list);
+}
+
+// Aplică o schimbare primită de la tracker: peer-ul deține acum segmentul.
+// Întoarce 1 dacă harta s-a schimbat.
+static int peer_list_grant(PeerList* peer_list, int peer, int segment) {
+    uint64_t** bits = &peer_list->bits[peer];
+    if (!*bits && !(*bits = calloc(BITMAP_WORDS(peer_list->header->n_segments), sizeof(uint64_t)))) {
+        return 0;
+    }
+    if (bitmap_test(*bits, segment)) {
+        return 0;
+    }
+
+    bitmap_set(*bits, segment);
+    peer_list->replicas[segment]++;
+    return 1;
+}
+
+// Hash-ul segmentului deținut de peer sau NULL dacă peer-ul nu îl are
+static inline const segment_digest* peer_list_hash(const PeerList* peer_list, int peer, int segment) {
+    const uint64_t* bits = peer_list->bits[peer];
+    return bits && bitmap_test(bits, segment) ? &peer_list->hashes[segment] : NULL;
+}
+
+// Funcția principală pentru obținerea listei de peer-uri
+PeerList* getPeerList(int number_of_tasks, int file_id) {
+    int tracker = tracker_for_file(file_id);
+    TrackerRequest request = {.signal = MSG_REQUEST, .file_id = file_id};
+    double traced = trace_begin();
+    MPI_Send(&request, sizeof(request), MPI_BYTE, tracker, 1, MPI_COMM_WORLD);
+    metric_sent(METRIC_PEER_LIST_REQUEST, sizeof(request));
+
+    // Răspunsul vine într-un singur mesaj de dimensiune variabilă
+    MPI_Status status;
+    int size;
+    CHECK_MPI(MPI_Probe(tracker, 0, MPI_COMM_WORLD, &status));
+    CHECK_MPI(MPI_Get_count(&status, MPI_BYTE, &size));
+
+    PeerList* peer_list = calloc(1, sizeof(PeerList));
+    if (!peer_list || !(peer_list->buffer = malloc(size))) {
+        fprintf(stderr, "Failed to allocate peer list\n");
+        free(peer_list);
+        // Mesajul trebuie consumat chiar dacă nu îl putem folosi
+        CHECK_MPI(MPI_Recv(NULL, 0, MPI_BYTE, tracker, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE));
+        return NULL;
+    }
+    CHECK_MPI(MPI_Recv(peer_list->buffer, size, MPI_BYTE, tracker, 0, MPI_COMM_WORLD,
+                       MPI_STATUS_IGNORE));
+    metric_received(METRIC_PEER_LIST, size);
+    trace_end("peer list fetch", traced, "file", file_id);
+
+    // Validare antet
+    peer_list->header = peer_list->buffer;
+    peer_list->number_of_tasks = number_of_tasks;
+    int n_segments = peer_list->header->n_segments;
+    int n_peers = peer_list->header->n_peers;
+
+    if (size < (int)sizeof(PeerListHeader) || n_segments <= 0 ||
+        n_peers < 0 || n_peers >= number_of_tasks || size != peer_list_size(n_segments, n_peers)) {
+        fprintf(stderr, "Invalid peer list for file %d: segments=%d, peers=%d\n",
+                file_id, n_segments, n_peers);
+        free_peer_list(peer_list);
+        return NULL;
+    }
+
+    int words = BITMAP_WORDS(n_segments);
+    const uint64_t* bits = (const uint64_t*)((char*)peer_list->buffer + sizeof(PeerListHeader));
+    const int* peers = (const int*)(bits + n_peers * words);
+    const int* replicas = peers + n_peers;
+    peer_list->hashes = (const segment_digest*)(replicas + n_segments);
+
+    peer_list->bits = calloc(number_of_tasks, sizeof(uint64_t*));
+    peer_list->replicas = malloc(n_segments * sizeof(int));
+    if (!peer_list->bits || !peer_list->replicas) {
+        fprintf(stderr, "Failed to allocate peer list index\n");
+        free_peer_list(peer_list);
+        return NULL;
+    }
+    memcpy(peer_list->replicas, replicas, n_segments * sizeof(int));
+
+    for (int i = 0; i < n_peers; i++) {
+        // Validarea indicilor primiți
+        if (peers[i] < 0 || peers[i] >= number_of_tasks || peer_list->bits[peers[i]]) {
+            fprintf(stderr, "Invalid peer index %d\n", peers[i]);
+            free_peer_list(peer_list);
+            return NULL;
+        }
+        if (!(peer_list->bits[peers[i]] = malloc(words * sizeof(uint64_t)))) {
+            fprintf(stderr, "Failed to allocate peer list index\n");
+            free_peer_list(peer_list);
+            return NULL;
+        }
+        memcpy(peer_list->bits[peers[i]], bits + i * words, words * sizeof(uint64_t));
+    }
+
+    if (n_peers == 0) {
+        fprintf(stderr, "Warning: No valid segments received\n");
+    }
+
+    return peer_list;
+}
+
+
+
+// Trimite tracker-ului segmentele strânse în mesaj și le marchează anunțate
+static void flush_segment_update(int file_id, file_info* owned_file, UpdateHeader* header) {
+    const int* segment_ids = (const int*)(header + 1);
+    header->seq = ++owned_file->update_seq;
+    MPI_Send(header, sizeof(UpdateHeader) + header->n_segments * sizeof(int), MPI_BYTE,
+             tracker_for_file(file_id), 1, MPI_COMM_WORLD);
+    metric_sent(METRIC_UPDATE, sizeof(UpdateHeader) + header->n_segments * sizeof(int));
+
+    // Livrarea MPI este sigură și ordonată: după trimitere segmentele sunt anunțate
+    for (int i = 0; i < header->n_segments; i++) {
+        bitmap_set(owned_file->advertised, segment_ids[i]);
+    }
+    header->n_segments = 0;
+}
+
+// Helper function to advertise to the tracker only the segments gained
+// since the previous update
+void send_segment_update(int file_id, file_info *owned_file) {
+    int* buffer = malloc(TRACKER_MESSAGE_SIZE);
+    if (!buffer) {
+        fprintf(stderr, "Failed to allocate update for file %d\n", file_id);
+        return;
+    }
+
+    UpdateHeader* header = (UpdateHeader*)buffer;
+    int* segment_ids = (int*)(header + 1);
+    header->signal = MSG_UPDATE;
+    header->file_id = file_id;
+    header->n_segments = 0;
+
+    // Doar cuvintele cu segmente prezente și neanunțate contează
+    for (int w = 0; w < BITMAP_WORDS(owned_file->n_segments); w++) {
+        uint64_t added = owned_file->present[w] & ~owned_file->advertised[w];
+        while (added) {
+            segment_ids[header->n_segments++] = w * 64 + __builtin_ctzll(added);
+            added &= added - 1;
+            if (header->n_segments == UPDATE_MAX_SEGMENTS) {
+                flush_segment_update(file_id, owned_file, header);
+            }
+        }
+    }
+    if (header->n_segments > 0) {
+        flush_segment_update(file_id, owned_file, header);
+    }
+
+    free(buffer);
+}
+
+// Scrierea rezultatului: clientN_fileM are câte o înregistrare de lățime fixă
+// (hash-ul hex și '\n') per segment, deci fiecare segment descărcat își are
+// locul cunoscut în fișierul prealocat la pornirea descărcării. Înregistrările
+// sunt scrise de un thread separat, care grupează în loturi înregistrările
+// alăturate, iar la final face un singur fsync per fișier.
+#define OUTPUT_RECORD_SIZE (HASH_SIZE + 1)
+
+typedef struct {
+    int fd;
+    int finish;                        // fsync și închidere, după înregistrările fd-ului
+    off_t offset;
+    char record[OUTPUT_RECORD_SIZE];
+} OutputJob;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t drained;            // Coada golită și lotul preluat scris
+    OutputJob* jobs;
+    int n_jobs;
+    int capacity;
+    int writing;                       // Thread-ul scrie un lot preluat din coadă
+    int stopping;
+    pthread_t thread;
+} OutputWriter;
+
+OutputWriter output_writer = {.lock = PTHREAD_MUTEX_INITIALIZER, .ready = PTHREAD_COND_INITIALIZER,
+                              .drained = PTHREAD_COND_INITIALIZER};
+
+static void output_execute(const OutputJob* job) {
+    if (job->finish) {
+        if (fsync(job->fd) < 0) {
+            fprintf(stderr, "Failed to sync output file\n");
+        }
+        close(job->fd);
+    } else if (pwrite(job->fd, job->record, OUTPUT_RECORD_SIZE, job->offset) != OUTPUT_RECORD_SIZE) {
+        fprintf(stderr, "Failed to write output record\n");
+    }
+}
+
+static void output_enqueue(const OutputJob* job) {
+    pthread_mutex_lock(&output_writer.lock);
+    if (output_writer.n_jobs == output_writer.capacity) {
+        int capacity = output_writer.capacity ? output_writer.capacity * 2 : 64;
+        OutputJob* jobs = realloc(output_writer.jobs, capacity * sizeof(OutputJob));
+        if (!jobs) {
+            // Fără loc în coadă: după ce thread-ul a scris tot ce era înainte,
+            // înregistrarea (sau închiderea) e executată pe loc, în ordine
+            while (output_writer.n_jobs > 0 || output_writer.writing) {
+                pthread_cond_signal(&output_writer.ready);
+                pthread_cond_wait(&output_writer.drained, &output_writer.lock);
+            }
+            output_execute(job);
+            pthread_mutex_unlock(&output_writer.lock);
+            return;
+        }
+        output_writer.jobs = jobs;
+        output_writer.capacity = capacity;
+    }
+    output_writer.jobs[output_writer.n_jobs++] = *job;
+    pthread_cond_signal(&output_writer.ready);
+    pthread_mutex_unlock(&output_writer.lock);
+}
+
+static int compare_output_jobs(const void* a, const void* b) {
+    const OutputJob* x = a;
+    const OutputJob* y = b;
+    if (x->finish != y->finish) return x->finish - y->finish;
+    if (x->fd != y->fd) return x->fd - y->fd;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+// Scrie un lot: înregistrările alăturate din același fișier devin un singur
+// pwrite, iar închiderile vin după toate înregistrările
+static void output_write_batch(OutputJob* jobs, int n) {
+    qsort(jobs, n, sizeof(OutputJob), compare_output_jobs);
+
+    char* run = malloc((size_t)n * OUTPUT_RECORD_SIZE);
+    for (int i = 0; i < n;) {
+        int j = i + 1;
+        while (run && !jobs[i].finish && j < n && !jobs[j].finish && jobs[j].fd == jobs[i].fd &&
+               jobs[j].offset == jobs[i].offset + (off_t)(j - i) * OUTPUT_RECORD_SIZE) {
+            j++;
+        }
+
+        if (j - i == 1) {
+            output_execute(&jobs[i]);
+        } else {
+            for (int k = i; k < j; k++) {
+                memcpy(run + (size_t)(k - i) * OUTPUT_RECORD_SIZE, jobs[k].record, OUTPUT_RECORD_SIZE);
+            }
+            ssize_t size = (ssize_t)(j - i) * OUTPUT_RECORD_SIZE;
+            if (pwrite(jobs[i].fd, run, size, jobs[i].offset) != size) {
+                fprintf(stderr, "Failed to write output records\n");
+            }
+        }
+        i = j;
+    }
+    free(run);
+}
+
+static void* output_writer_func(void* arg) {
+    (void)arg;
+
+    for (;;) {
+        pthread_mutex_lock(&output_writer.lock);
+        while (output_writer.n_jobs == 0 && !output_writer.stopping) {
+            pthread_cond_wait(&output_writer.ready, &output_writer.lock);
+        }
+        if (output_writer.n_jobs == 0) {
+            pthread_mutex_unlock(&output_writer.lock);
+            break;
+        }
+
+        // Lotul este preluat întreg, iar coada pornește de la zero
+        OutputJob* jobs = output_writer.jobs;
+        int n_jobs = output_writer.n_jobs;
+        output_writer.jobs = NULL;
+        output_writer.n_jobs = 0;
+        output_writer.capacity = 0;
+        output_writer.writing = 1;
+        pthread_mutex_unlock(&output_writer.lock);
+
+        output_write_batch(jobs, n_jobs);
+        free(jobs);
+
+        pthread_mutex_lock(&output_writer.lock);
+        output_writer.writing = 0;
+        pthread_cond_broadcast(&output_writer.drained);
+        pthread_mutex_unlock(&output_writer.lock);
+    }
+
+    return NULL;
+}
+
+static void output_writer_start(void) {
+    if (pthread_create(&output_writer.thread, NULL, output_writer_func, NULL) != 0) {
+        fprintf(stderr, "Eroare la crearea thread-ului de scriere\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Scrie tot ce a rămas în coadă și oprește thread-ul
+static void output_writer_stop(void) {
+    pthread_mutex_lock(&output_writer.lock);
+    output_writer.stopping = 1;
+    pthread_cond_signal(&output_writer.ready);
+    pthread_mutex_unlock(&output_writer.lock);
+
+    if (pthread_join(output_writer.thread, NULL) != 0) {
+        fprintf(stderr, "Eroare la așteptarea thread-ului de scriere\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Creează fișierul rezultat, prealocat la dimensiunea finală; -1 la eroare
+static int output_open(int rank, const file_info* file) {
+    char output_file[MAX_FILENAME + 32];
+    sprintf(output_file, "client%d_%s", rank, file->name);
+
+    int fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error opening file %s for writing\n", output_file);
+        return -1;
+    }
+
+    off_t size = (off_t)file->n_segments * OUTPUT_RECORD_SIZE;
+    if (size > 0 && posix_fallocate(fd, 0, size) != 0 && ftruncate(fd, size) < 0) {
+        fprintf(stderr, "Failed to preallocate %s\n", output_file);
+    }
+    return fd;
+}
+
+static void output_record(int fd, int segment, const segment_digest* hash) {
+    if (fd < 0) {
+        return;
+    }
+
+    OutputJob job = {.fd = fd, .offset = (off_t)segment * OUTPUT_RECORD_SIZE};
+    format_digest(hash, job.record);
+    job.record[HASH_SIZE] = '\n';
+    output_enqueue(&job);
+}
+
+static void output_close(int fd) {
+    if (fd >= 0) {
+        OutputJob job = {.fd = fd, .finish = 1};
+        output_enqueue(&job);
+    }
+}
+
+// Cereri de segmente către peers, fără așteptare sincronă: fiecare cerere
+// grupează până la REQUEST_BATCH segmente pentru același peer, iar răspunsul
+// este un singur vector de stări. Cererile în curs sunt limitate global
+// (DOWNLOAD_WINDOW) și per peer (PEER_WINDOW).
+typedef struct {
+    int signal;                        // MSG_REQUEST
+    int n_segments;                    // Numărul de hash-uri care urmează
+    int reply_tag;                     // Tag-ul pe care se așteaptă răspunsul
+} SegmentRequestHeader;
+
+typedef struct {
+    SegmentRequestHeader header;
+    segment_digest hashes[REQUEST_BATCH];
+} SegmentRequestMessage;
+
+// Mesaj schimbat între doi peers care descarcă același fișier. La primul
+// contact fiecare trimite MSG_BITFIELD (n_segments = numărul de segmente ale
+// fișierului, urmat de bitset), apoi MSG_HAVE (n_segments ID-uri) pentru
+// fiecare cerere încheiată.
+typedef struct {
+    int signal;
+    int file_id;
+    int n_segments;
+} GossipHeader;
+
+struct FileDownload;
+
+typedef struct {
+    int active;
+    int peer;
+    struct FileDownload* download;     // Fișierul căruia îi aparțin segmentele
+    int segment_ids[REQUEST_BATCH];
+    int status[REQUEST_BATCH];         // Răspunsul peer-ului (MSG_ACK sau -1)
+    MPI_Request payload[REQUEST_BATCH];  // Conținutul segmentelor, cu depozitul activ
+    int duplicate[REQUEST_BATCH];      // Conținutul vine în scratch, nu în depozit
+    uint8_t* scratch;                  // REQUEST_BATCH segmente, alocat la nevoie
+    SegmentRequestMessage message;
+    MPI_Request send_request;
+    double sent_at;                    // MPI_Wtime() la trimitere
+    double traced_at;                  // Începutul intervalului în trasare
+} InFlightRequest;
+
+// Starea descărcării unui fișier
+typedef struct FileDownload {
+    int file_id;
+    int n_segments;
+    PeerList* peer_list;
+    uint64_t* in_flight;               // Segmente cerute și încă fără răspuns
+    unsigned char* requests;           // Cereri în curs per segment (peste 1 doar în endgame)
+    int* attempts;                     // Cereri eșuate per segment
+    int* order;                        // Segmentele rămase, în ordinea cererii (rarest-first)
+    int* position;                     // Poziția segmentului în order (-1 = nu e în order)
+    int n_order;
+    int* next_segment;                 // Cursorul fiecărui peer în order
+    unsigned int rng;                  // Starea pentru departajarea aleatoare
+    int missing;                       // Segmente încă nedescărcate
+    int n_requests;                    // Cereri în curs pentru acest fișier
+    int stalls;                        // Reîmprospătări consecutive fără progres
+    int completed_since_order;         // Segmente descărcate de la ultima ordonare
+    int order_dirty;                   // Harta s-a schimbat de la ultima ordonare
+    int unadvertised;
+    uint64_t* contacted;               // Peers cărora li s-a trimis bitfield-ul
+    uint64_t* connected;               // Peers de la care s-a primit bitfield-ul
+    int output_fd;                     // Fișierul rezultat, scris incremental
+    double started_at;                 // MPI_Wtime() la pornirea descărcării
+} FileDownload;
+
+// Cele până la PARALLEL_FILES fișiere descărcate simultan împart fereastra
+// de cereri; segmentele lor sunt cerute întrețesut, cu prioritate rotativă
+typedef struct DownloadEngine {
+    int rank;
+    int number_of_tasks;
+    InFlightRequest slots[DOWNLOAD_WINDOW];
+    MPI_Request replies[DOWNLOAD_WINDOW];  // MPI_REQUEST_NULL pentru sloturi libere
+    int n_active;
+    int* peer_outstanding;             // Cereri în curs per peer
+    double* peer_latency;              // EWMA a timpului de răspuns per peer (0 = necunoscut)
+    int next_peer;                     // Cursorul pentru POLICY_ROUND_ROBIN
+    PeerPolicy policy;
+    FileDownload files[PARALLEL_FILES];
+    int file_active[PARALLEL_FILES];
+    int n_files;                       // Fișiere în curs de descărcare
+    int next_file;                     // Următoarea poziție din wish_list
+    int subscriptions;                 // Fișiere începute fără AVAILABILITY_END primit
+    long long bytes_received;          // Conținut verificat primit în depozitul de segmente
+    double first_segment_at;           // MPI_Wtime() la primul segment confirmat
+    int gossip;
+    int endgame;                       // Pragul de segmente lipsă (0 = fără endgame)
+    PendingSend* gossip_sends;         // Mesaje către peers încă nepotrivite de destinatar
+    int n_gossip_sends;
+    int gossip_sends_capacity;
+} DownloadEngine;
+
+typedef struct {
+    int replicas;
+    int tiebreak;
+    int segment;
+} SegmentRank;
+
+static int compare_segment_rank(const void* a, const void* b) {
+    const SegmentRank* x = a;
+    const SegmentRank* y = b;
+    if (x->replicas != y->replicas) return x->replicas < y->replicas ? -1 : 1;
+    if (x->tiebreak != y->tiebreak) return x->tiebreak < y->tiebreak ? -1 : 1;
+    return x->segment - y->segment;
+}
+
+// Ordonează segmentele încă nedescărcate după numărul de replici din swarm
+// (cele mai rare întâi), cu departajare aleatoare ca să nu ceară toți clienții
+// aceleași segmente. Cursoarele peers-ilor pornesc din nou de la început.
+static void order_segments(FileDownload* download, int number_of_tasks) {
+    const file_info* owned = &users_files[download->file_id];
+    SegmentRank* ranks = malloc(download->n_segments * sizeof(SegmentRank));
+    if (!ranks) {
+        return;  // Se păstrează ordinea anterioară
+    }
+
+    int n = 0;
+    for (int seg = 0; seg < download->n_segments; seg++) {
+        download->position[seg] = -1;
+        if (bitmap_test(owned->present, seg) || download->attempts[seg] >= MAX_REQUEST_ATTEMPTS) {
+            continue;
+        }
+        ranks[n].replicas = download->peer_list->replicas[seg];
+        ranks[n].tiebreak = rand_r(&download->rng);
+        ranks[n].segment = seg;
+        n++;
+    }
+    qsort(ranks, n, sizeof(SegmentRank), compare_segment_rank);
+
+    for (int i = 0; i < n; i++) {
+        download->order[i] = ranks[i].segment;
+        download->position[ranks[i].segment] = i;
+    }
+    free(ranks);
+    download->n_order = n;
+    for (int p = 0; p < number_of_tasks; p++) {
+        download->next_segment[p] = 0;
+    }
+    download->completed_since_order = 0;
+    download->order_dirty = 0;
+}
+
+// Ordinea se recalculează după destule segmente descărcate sau, fără cereri
+// în curs, imediat: segmentele trecute de cursoare pot avea acum deținători
+static int order_due(const FileDownload* download) {
+    return download->order_dirty &&
+           (download->n_requests == 0 ||
+            (download->completed_since_order >= ORDER_REFRESH &&
+             download->completed_since_order * ORDER_REFRESH_SHARE >= download->n_order));
+}
+
+static void end_file_download(FileDownload* download) {
+    free_peer_list(download->peer_list);
+    free(download->in_flight);
+    free(download->requests);
+    free(download->attempts);
+    free(download->order);
+    free(download->position);
+    free(download->next_segment);
+    free(download->contacted);
+    free(download->connected);
+}
+
+static int start_file_download(FileDownload* download, int file_id, int rank, int number_of_tasks,
+                               unsigned int seed) {
+    memset(download, 0, sizeof(*download));
+    download->file_id = file_id;
+    download->rng = seed;
+    download->started_at = MPI_Wtime();
+
+    download->peer_list = getPeerList(number_of_tasks, file_id);
+    if (!download->peer_list) {
+        return -1;
+    }
+
+    int n_segments = download->peer_list->header->n_segments;
+    download->n_segments = n_segments;
+    download->in_flight = calloc(BITMAP_WORDS(n_segments), sizeof(uint64_t));
+    download->requests = calloc(n_segments, 1);
+    download->attempts = calloc(n_segments, sizeof(int));
+    download->order = malloc(n_segments * sizeof(int));
+    download->position = malloc(n_segments * sizeof(int));
+    download->next_segment = calloc(number_of_tasks, sizeof(int));
+    download->contacted = calloc(BITMAP_WORDS(number_of_tasks), sizeof(uint64_t));
+    download->connected = calloc(BITMAP_WORDS(number_of_tasks), sizeof(uint64_t));
+    if (!download->in_flight || !download->requests || !download->attempts || !download->order ||
+        !download->position || !download->next_segment || !download->contacted ||
+        !download->connected) {
+        end_file_download(download);
+        return -1;
+    }
+
+    if (reserve_file_storage(file_id, n_segments) < 0 ||
+        piece_store_create(rank, file_id, n_segments) < 0) {
+        end_file_download(download);
+        return -1;
+    }
+    memset(download->position, 0xff, n_segments * sizeof(int));
+    order_segments(download, number_of_tasks);
+    // Segmentele deținute deja își au înregistrarea scrisă de la început
+    download->output_fd = output_open(rank, &users_files[file_id]);
+    for (int seg = 0; seg < n_segments; seg++) {
+        if (!bitmap_test(users_files[file_id].present, seg)) {
+            download->missing++;
+        } else {
+            output_record(download->output_fd, seg, &users_files[file_id].segments[seg]);
+        }
+    }
+
+    return 0;
+}
+
+// Trimite un mesaj către alt peer. Trimiterea sincronă se încheie abia când
+// destinatarul l-a primit, deci după ce toate s-au încheiat nu mai rămâne
+// niciun mesaj nepotrivit la bariera de terminare.
+static void send_gossip(DownloadEngine* engine, int dest, GossipHeader* message, int size) {
+    if (engine->n_gossip_sends == engine->gossip_sends_capacity) {
+        int capacity = engine->gossip_sends_capacity ? engine->gossip_sends_capacity * 2 : 16;
+        PendingSend* sends = realloc(engine->gossip_sends, capacity * sizeof(PendingSend));
+        if (!sends) {
+            fprintf(stderr, "Failed to queue gossip for %d\n", dest);
+            free(message);
+            return;
+        }
+        engine->gossip_sends = sends;
+        engine->gossip_sends_capacity = capacity;
+    }
+
+    PendingSend* send = &engine->gossip_sends[engine->n_gossip_sends++];
+    send->buffer = message;
+    CHECK_MPI(MPI_Issend(message, size, MPI_BYTE, dest, TAG_GOSSIP, MPI_COMM_WORLD, &send->request));
+    metric_sent(METRIC_GOSSIP, size);
+}
+
+// Eliberează mesajele către peers deja primite
+static void complete_gossip(DownloadEngine* engine) {
+    int kept = 0;
+    for (int i = 0; i < engine->n_gossip_sends; i++) {
+        int done;
+        CHECK_MPI(MPI_Test(&engine->gossip_sends[i].request, &done, MPI_STATUS_IGNORE));
+        if (done) {
+            free(engine->gossip_sends[i].buffer);
+        } else {
+            engine->gossip_sends[kept++] = engine->gossip_sends[i];
+        }
+    }
+    engine->n_gossip_sends = kept;
+}
+
+// Trimite peer-ului toate segmentele deținute din fișier
+static void send_bitfield(DownloadEngine* engine, FileDownload* download, int peer) {
+    int words = BITMAP_WORDS(download->n_segments);
+    int size = sizeof(GossipHeader) + words * sizeof(uint64_t);
+    GossipHeader* message = malloc(size);
+    if (!message) {
+        fprintf(stderr, "Failed to allocate bitfield for %d\n", peer);
+        return;
+    }
+
+    bitmap_set(download->contacted, peer);
+    message->signal = MSG_BITFIELD;
+    message->file_id = download->file_id;
+    message->n_segments = download->n_segments;
+    memcpy(message + 1, users_files[download->file_id].present, words * sizeof(uint64_t));
+    send_gossip(engine, peer, message, size);
+}
+
+// Anunță peers care descarcă și ei fișierul că segmentele au fost descărcate
+static void send_have(DownloadEngine* engine, FileDownload* download, const int* segment_ids, int n) {
+    int size = sizeof(GossipHeader) + n * sizeof(int);
+    for (int p = n_trackers; p < engine->number_of_tasks; p++) {
+        if (!bitmap_test(download->connected, p)) {
+            continue;
+        }
+
+        GossipHeader* message = malloc(size);
+        if (!message) {
+            fprintf(stderr, "Failed to allocate have for %d\n", p);
+            return;
+        }
+        message->signal = MSG_HAVE;
+        message->file_id = download->file_id;
+        message->n_segments = n;
+        memcpy(message + 1, segment_ids, n * sizeof(int));
+        send_gossip(engine, p, message, size);
+    }
+}
+
+// Bufferul în care se primește conținutul segmentului k din slot în afara depozitului
+static uint8_t* slot_scratch(InFlightRequest* slot, int k) {
+    if (!slot->scratch &&
+        !(slot->scratch = malloc((size_t)REQUEST_BATCH * piece_store.segment_size))) {
+        fprintf(stderr, "Failed to allocate request buffer\n");
+        exit(EXIT_FAILURE);
+    }
+    return slot->scratch + (size_t)k * piece_store.segment_size;
+}
+
+// Trimite cererea grupată din slot și postează recepția vectorului de răspuns
+static void issue_request(DownloadEngine* engine, int slot_id) {
+    InFlightRequest* slot = &engine->slots[slot_id];
+    int n_segments = slot->message.header.n_segments;
+
+    // Primul contact cu peer-ul pentru acest fișier; un seed nu răspunde, deci
+    // nu va primi nici HAVE-uri
+    if (engine->gossip && !bitmap_test(slot->download->contacted, slot->peer)) {
+        send_bitfield(engine, slot->download, slot->peer);
+    }
+
+    slot->message.header.signal = MSG_REQUEST;
+    slot->message.header.reply_tag = TAG_PEER_REPLY + slot_id;
+    CHECK_MPI(MPI_Irecv(slot->status, n_segments, MPI_INT, slot->peer, TAG_PEER_REPLY + slot_id,
+                        MPI_COMM_WORLD, &engine->replies[slot_id]));
+
+    // Conținutul vine după stări direct la offset-ul final; un duplicat din
+    // endgame primește în scratch, ca două recepții să nu scrie același segment
+    for (int k = 0; piece_store.dir && k < n_segments; k++) {
+        void* target = slot->duplicate[k]
+                           ? (void*)slot_scratch(slot, k)
+                           : (void*)piece_address(slot->download->file_id, slot->segment_ids[k]);
+        CHECK_MPI(MPI_Irecv(target, piece_store.segment_size, MPI_BYTE, slot->peer,
+                            payload_tag(slot->message.header.reply_tag, k), MPI_COMM_WORLD,
+                            &slot->payload[k]));
+    }
+    CHECK_MPI(MPI_Isend(&slot->message, sizeof(SegmentRequestHeader) + n_segments * DIGEST_SIZE,
+                        MPI_BYTE, slot->peer, 1, MPI_COMM_WORLD, &slot->send_request));
+    metric_sent(METRIC_SEGMENT_REQUEST, sizeof(SegmentRequestHeader) + n_segments * DIGEST_SIZE);
+
+    slot->active = 1;
+    slot->sent_at = MPI_Wtime();
+    slot->traced_at = trace_begin();
+    engine->n_active++;
+    engine->peer_outstanding[slot->peer]++;
+    slot->download->n_requests++;
+}
+
+static int free_slot(const DownloadEngine* engine) {
+    for (int i = 0; i < DOWNLOAD_WINDOW; i++) {
+        if (!engine->slots[i].active) return i;
+    }
+    return -1;
+}
+
+static const char* const peer_policy_names[POLICY_COUNT] = {
+    [POLICY_FIRST] = "first",
+    [POLICY_LEAST_OUTSTANDING] = "least-outstanding",
+    [POLICY_ROUND_ROBIN] = "round-robin",
+    [POLICY_LATENCY] = "latency",
+};
+
+PeerPolicy parse_peer_policy(const char* name) {
+    if (!name || !*name) {
+        return POLICY_LEAST_OUTSTANDING;
+    }
+    for (int i = 0; i < POLICY_COUNT; i++) {
+        if (strcmp(name, peer_policy_names[i]) == 0) {
+            return i;
+        }
+    }
+    fprintf(stderr, "Unknown peer policy %s, using %s\n",
+            name, peer_policy_names[POLICY_LEAST_OUTSTANDING]);
+    return POLICY_LEAST_OUTSTANDING;
+}
+
+// Peer-ul poate primi o cerere pentru segment
+static inline int peer_candidate(const DownloadEngine* engine, const FileDownload* download,
+                                 int p, int seg) {
+    return p != engine->rank && engine->peer_outstanding[p] < PEER_WINDOW &&
+           peer_list_hash(download->peer_list, p, seg);
+}
+
+// Alege peer-ul pentru segment conform politicii; -1 dacă nu există niciunul liber
+static int choose_peer(DownloadEngine* engine, const FileDownload* download, int seg) {
+    int n = engine->number_of_tasks;
+    int best = -1;
+    double best_score = 0;
+
+    switch (engine->policy) {
+        case POLICY_FIRST:
+            for (int p = n_trackers; p < n; p++) {
+                if (peer_candidate(engine, download, p, seg)) {
+                    return p;
+                }
+            }
+            break;
+
+        case POLICY_ROUND_ROBIN:
+            for (int k = 0; k < n; k++) {
+                int p = (engine->next_peer + k) % n;
+                if (peer_candidate(engine, download, p, seg)) {
+                    engine->next_peer = (p + 1) % n;
+                    return p;
+                }
+            }
+            break;
+
+        case POLICY_LEAST_OUTSTANDING:
+        case POLICY_LATENCY:
+            for (int p = n_trackers; p < n; p++) {
+                if (!peer_candidate(engine, download, p, seg)) {
+                    continue;
+                }
+
+                // Peers fără măsurători au scor 0, deci sunt încercați primii
+                double score = engine->policy == POLICY_LATENCY
+                                   ? engine->peer_latency[p] * (engine->peer_outstanding[p] + 1)
+                                   : engine->peer_outstanding[p];
+                if (best < 0 || score < best_score) {
+                    best = p;
+                    best_score = score;
+                }
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    return best;
+}
+
+// Peer-ul are deja o cerere (trimisă sau în curs de grupare) pentru segment
+static int peer_asked(const DownloadEngine* engine, const FileDownload* download, int peer, int seg) {
+    for (int i = 0; i < DOWNLOAD_WINDOW; i++) {
+        const InFlightRequest* slot = &engine->slots[i];
+        if (!slot->active || slot->download != download || slot->peer != peer) {
+            continue;
+        }
+        for (int k = 0; k < slot->message.header.n_segments; k++) {
+            if (slot->segment_ids[k] == seg) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Deținătorul cel mai puțin ocupat care nu a primit încă cererea pentru segment
+static int endgame_peer(const DownloadEngine* engine, const FileDownload* download, int seg) {
+    int best = -1;
+    double best_score = 0;
+    for (int p = n_trackers; p < engine->number_of_tasks; p++) {
+        if (!peer_candidate(engine, download, p, seg) || peer_asked(engine, download, p, seg)) {
+            continue;
+        }
+        double score = engine->policy == POLICY_LATENCY
+                           ? engine->peer_latency[p] * (engine->peer_outstanding[p] + 1)
+                           : engine->peer_outstanding[p];
+        if (best < 0 || score < best_score) {
+            best = p;
+            best_score = score;
+        }
+    }
+    return best;
+}
+
+// Adaugă segmentul în cererea deschisă pentru peer sau într-una nouă, trimisă
+// când se umple. Întoarce 1 dacă s-a trimis o cerere, -1 dacă fereastra e plină.
+static int batch_segment(DownloadEngine* engine, FileDownload* download, int* open_slot,
+                         int peer, int seg) {
+    int slot_id = open_slot[peer];
+    if (slot_id < 0) {
+        if ((slot_id = free_slot(engine)) < 0) {
+            return -1;
+        }
+        engine->slots[slot_id].peer = peer;
+        engine->slots[slot_id].download = download;
+        engine->slots[slot_id].message.header.n_segments = 0;
+        engine->slots[slot_id].active = 1;  // Rezervat până la trimitere
+        open_slot[peer] = slot_id;
+    }
+
+    InFlightRequest* slot = &engine->slots[slot_id];
+    int k = slot->message.header.n_segments++;
+    slot->segment_ids[k] = seg;
+    slot->message.hashes[k] = *peer_list_hash(download->peer_list, peer, seg);
+    slot->duplicate[k] = download->requests[seg]++ > 0;
+    bitmap_set(download->in_flight, seg);
+
+    if (k + 1 == REQUEST_BATCH) {
+        slot->active = 0;
+        issue_request(engine, slot_id);
+        open_slot[peer] = -1;
+        return 1;
+    }
+    return 0;
+}
+
+// Primul segment din order, de la cursorul peer-ului încolo, care se poate
+// cere de la el. Segmentele sărite nu mai devin ceribile de la peer până la
+// reordonare, cu excepția celor eșuate, pentru care cursorul este readus înapoi.
+static int peer_next_segment(FileDownload* download, int p) {
+    const file_info* owned = &users_files[download->file_id];
+    int* i = &download->next_segment[p];
+    for (; *i < download->n_order; (*i)++) {
+        int seg = download->order[*i];
+        if (!bitmap_test(owned->present, seg) && !bitmap_test(download->in_flight, seg) &&
+            download->attempts[seg] < MAX_REQUEST_ATTEMPTS &&
+            peer_list_hash(download->peer_list, p, seg)) {
+            return *i;
+        }
+    }
+    return -1;
+}
+
+// Segmentul a eșuat și poate fi cerut din nou de la deținătorii lui
+static void retry_segment(const DownloadEngine* engine, FileDownload* download, int seg) {
+    int i = download->position[seg];
+    for (int p = n_trackers; i >= 0 && p < engine->number_of_tasks; p++) {
+        if (download->next_segment[p] > i && peer_list_hash(download->peer_list, p, seg)) {
+            download->next_segment[p] = i;
+        }
+    }
+}
+
+// Umple fereastra cu cereri pentru segmentele lipsă; întoarce numărul de cereri noi
+static int fill_window(DownloadEngine* engine, FileDownload* download) {
+    if (engine->n_active == DOWNLOAD_WINDOW) {
+        return 0;
+    }
+
+    int issued = 0;
+    file_info* owned = &users_files[download->file_id];
+    int open_slot[engine->number_of_tasks];
+    for (int p = 0; p < engine->number_of_tasks; p++) {
+        open_slot[p] = -1;
+    }
+
+    // Următorul segment în ordine este cel mai devreme dintre cele aflate la
+    // cursoarele peers-ilor cu loc în fereastră; fără astfel de peers, nu se
+    // mai parcurge nimic
+    int full = 0;
+    while (!full) {
+        int next = -1;
+        for (int p = n_trackers; p < engine->number_of_tasks; p++) {
+            if (p == engine->rank || engine->peer_outstanding[p] >= PEER_WINDOW) {
+                continue;
+            }
+            int i = peer_next_segment(download, p);
+            if (i >= 0 && (next < 0 || i < next)) {
+                next = i;
+            }
+        }
+        if (next < 0) {
+            break;
+        }
+
+        int seg = download->order[next];
+        int result = batch_segment(engine, download, open_slot, choose_peer(engine, download, seg), seg);
+        full = result < 0;
+        issued += result > 0;
+    }
+
+    // Endgame: segmentele rămase, toate deja cerute, sunt cerute și de la alți
+    // deținători; primul conținut confirmat câștigă, celelalte răspunsuri sunt
+    // ignorate. Segmentele cerute se află toate în sloturile ferestrei.
+    int candidates[DOWNLOAD_WINDOW * REQUEST_BATCH];
+    int n_candidates = 0;
+    for (int i = 0; download->missing <= engine->endgame && i < DOWNLOAD_WINDOW; i++) {
+        const InFlightRequest* slot = &engine->slots[i];
+        for (int k = 0; slot->active && slot->download == download &&
+                        k < slot->message.header.n_segments; k++) {
+            candidates[n_candidates++] = slot->segment_ids[k];
+        }
+    }
+    for (int i = 0; i < n_candidates && !full; i++) {
+        int seg = candidates[i];
+        if (bitmap_test(owned->present, seg) || download->requests[seg] == 0 ||
+            download->requests[seg] >= ENDGAME_PEERS) {
+            continue;
+        }
+
+        int peer = endgame_peer(engine, download, seg);
+        if (peer < 0) {
+            continue;
+        }
+
+        int result = batch_segment(engine, download, open_slot, peer, seg);
+        full = result < 0;
+        issued += result > 0;
+    }
+
+    for (int p = 0; p < engine->number_of_tasks; p++) {
+        if (open_slot[p] >= 0) {
+            engine->slots[open_slot[p]].active = 0;
+            issue_request(engine, open_slot[p]);
+            issued++;
+        }
+    }
+
+    return issued;
+}
+
+// Un duplicat a câștigat segmentul: recepțiile directe încă în curs pentru el
+// sunt anulate, ca nimic să nu mai scrie peste conținutul copiat. Peer-ul
+// trimite oricum conținutul, deci recepția este repostată imediat în scratch;
+// altfel worker-ul lui de upload ar rămâne blocat în trimitere.
+static void claim_segment(DownloadEngine* engine, const InFlightRequest* winner, int seg) {
+    for (int i = 0; i < DOWNLOAD_WINDOW; i++) {
+        InFlightRequest* slot = &engine->slots[i];
+        if (slot == winner || !slot->active || slot->download != winner->download) {
+            continue;
+        }
+        for (int k = 0; k < slot->message.header.n_segments; k++) {
+            if (slot->segment_ids[k] != seg || slot->duplicate[k] ||
+                slot->payload[k] == MPI_REQUEST_NULL) {
+                continue;
+            }
+
+            MPI_Status status;
+            int cancelled;
+            CHECK_MPI(MPI_Cancel(&slot->payload[k]));
+            CHECK_MPI(MPI_Wait(&slot->payload[k], &status));
+            CHECK_MPI(MPI_Test_cancelled(&status, &cancelled));
+            if (cancelled) {
+                slot->duplicate[k] = 1;
+                CHECK_MPI(MPI_Irecv(slot_scratch(slot, k), piece_store.segment_size, MPI_BYTE,
+                                    slot->peer, payload_tag(slot->message.header.reply_tag, k),
+                                    MPI_COMM_WORLD, &slot->payload[k]));
+            }
+        }
+    }
+}
+
+// Procesează un răspuns sosit: segmentele confirmate devin deținute. Cererile
+// unui fișier deja terminat (duplicate din endgame) sunt doar încheiate.
+static void complete_request(DownloadEngine* engine, int slot_id) {
+    InFlightRequest* slot = &engine->slots[slot_id];
+    FileDownload* download = slot->download;
+    int n_segments = slot->message.header.n_segments;
+
+    CHECK_MPI(MPI_Wait(&slot->send_request, MPI_STATUS_IGNORE));
+
+    double elapsed = MPI_Wtime() - slot->sent_at;
+    metric_received(METRIC_SEGMENT_REPLY, n_segments * sizeof(int));
+    metric_observe(HISTOGRAM_PEER_ACK, elapsed * 1e6);
+    double* latency = &engine->peer_latency[slot->peer];
+    *latency = *latency == 0 ? elapsed
+                             : LATENCY_EWMA_ALPHA * elapsed + (1 - LATENCY_EWMA_ALPHA) * *latency;
+
+    MPI_Status payload_status[REQUEST_BATCH];
+    if (piece_store.dir) {
+        CHECK_MPI(MPI_Waitall(n_segments, slot->payload, payload_status));
+    }
+
+    int acked[REQUEST_BATCH];
+    int n_acked = 0;
+    for (int k = 0; download && k < n_segments; k++) {
+        int seg = slot->segment_ids[k];
+        file_info* owned = &users_files[download->file_id];
+        if (--download->requests[seg] == 0) {
+            download->in_flight[seg >> 6] &= ~(1ULL << (seg & 63));
+        }
+        if (bitmap_test(owned->present, seg)) {
+            continue;  // Câștigat deja de altă cerere din endgame
+        }
+
+        if (slot->status[k] == MSG_ACK && piece_store.dir) {
+            // Conținutul trebuie să corespundă hash-ului din manifest
+            int count;
+            segment_digest digest;
+            const uint8_t* data = slot->duplicate[k] ? slot_scratch(slot, k)
+                                                     : (const uint8_t*)piece_address(download->file_id, seg);
+            MPI_Get_count(&payload_status[k], MPI_BYTE, &count);
+            metric_received(METRIC_SEGMENT_PAYLOAD, count);
+            if (count == piece_store.segment_size) {
+                md5_digest(data, count, &digest);
+            }
+            if (count != piece_store.segment_size || !digest_equal(&digest, &slot->message.hashes[k])) {
+                fprintf(stderr, "Segment %d of file %d from %d failed verification\n",
+                        seg, download->file_id, slot->peer);
+                slot->status[k] = -1;
+            } else {
+                if (slot->duplicate[k]) {
+                    claim_segment(engine, slot, seg);
+                    memcpy(piece_address(download->file_id, seg), data, count);
+                }
+                engine->bytes_received += count;
+            }
+        }
+
+        if (slot->status[k] != MSG_ACK) {
+            download->attempts[seg]++;
+            retry_segment(engine, download, seg);
+            continue;
+        }
+
+        if (engine->first_segment_at == 0) {
+            engine->first_segment_at = MPI_Wtime();
+        }
+        add_owned_segment(download->file_id, seg, &slot->message.hashes[k]);
+        output_record(download->output_fd, seg, &slot->message.hashes[k]);
+        download->missing--;
+        download->completed_since_order++;
+        acked[n_acked++] = seg;
+
+        if (++download->unadvertised == (engine->gossip ? GOSSIP_UPDATE_BATCH : UPDATE_BATCH)) {
+            send_segment_update(download->file_id, owned);
+            download->unadvertised = 0;
+        }
+    }
+
+    if (engine->gossip && n_acked > 0) {
+        send_have(engine, download, acked, n_acked);
+    }
+
+    trace_end("segment request", slot->traced_at, "peer", slot->peer);
+    slot->active = 0;
+    engine->n_active--;
+    engine->peer_outstanding[slot->peer]--;
+    if (download) {
+        download->n_requests--;
+    }
+}
+
+static int refresh_peer_list(FileDownload* download, int number_of_tasks) {
+    PeerList* peer_list = getPeerList(number_of_tasks, download->file_id);
+    if (!peer_list) {
+        fprintf(stderr, "Failed to refresh peer list for file %d\n", download->file_id);
+        return -1;
+    }
+
+    // Segmentele aflate direct de la peers pot fi încă neanunțate tracker-ului
+    for (int p = 0; p < number_of_tasks; p++) {
+        const uint64_t* bits = download->peer_list->bits[p];
+        for (int seg = 0; bits && seg < download->n_segments; seg++) {
+            if (bitmap_test(bits, seg)) {
+                peer_list_grant(peer_list, p, seg);
+            }
+        }
+    }
+
+    free_peer_list(download->peer_list);
+    download->peer_list = peer_list;
+    order_segments(download, number_of_tasks);
+    return 0;
+}
+
+// Aplică schimbările de disponibilitate trimise de tracker-e fișierelor în
+// curs; cu wait, se blochează până la primul mesaj
+static void receive_availability(DownloadEngine* engine, int wait) {
+    for (;;) {
+        MPI_Status status;
+        int flag = 1;
+        if (wait) {
+            CHECK_MPI(MPI_Probe(MPI_ANY_SOURCE, TAG_AVAILABILITY, MPI_COMM_WORLD, &status));
+            wait = 0;
+        } else {
+            CHECK_MPI(MPI_Iprobe(MPI_ANY_SOURCE, TAG_AVAILABILITY, MPI_COMM_WORLD, &flag, &status));
+        }
+        if (!flag) {
+            return;
+        }
+
+        int size;
+        CHECK_MPI(MPI_Get_count(&status, MPI_BYTE, &size));
+        AvailabilityHeader* header = malloc(size);
+        if (!header) {
+            // Mesajul trebuie consumat chiar dacă nu îl putem folosi
+            fprintf(stderr, "Failed to allocate availability message\n");
+            CHECK_MPI(MPI_Recv(NULL, 0, MPI_BYTE, status.MPI_SOURCE, TAG_AVAILABILITY,
+                               MPI_COMM_WORLD, MPI_STATUS_IGNORE));
+            continue;
+        }
+        CHECK_MPI(MPI_Recv(header, size, MPI_BYTE, status.MPI_SOURCE, TAG_AVAILABILITY,
+                           MPI_COMM_WORLD, MPI_STATUS_IGNORE));
+        metric_received(METRIC_AVAILABILITY, size);
+
+        if (size < (int)sizeof(AvailabilityHeader)) {
+            fprintf(stderr, "Invalid availability message from %d\n", status.MPI_SOURCE);
+        } else if (header->n_segments == AVAILABILITY_END) {
+            engine->subscriptions--;
+        } else if (size != (int)(sizeof(AvailabilityHeader) + header->n_segments * sizeof(int)) ||
+                   header->rank < 0 || header->rank >= engine->number_of_tasks) {
+            fprintf(stderr, "Invalid availability message from %d\n", status.MPI_SOURCE);
+        } else {
+            // Fișierul poate fi deja terminat, caz în care schimbarea se ignoră
+            const int* segment_ids = (const int*)(header + 1);
+            for (int i = 0; i < PARALLEL_FILES; i++) {
+                FileDownload* download = &engine->files[i];
+                if (!engine->file_active[i] || download->file_id != header->file_id) {
+                    continue;
+                }
+
+                for (int k = 0; k < header->n_segments; k++) {
+                    if (segment_ids[k] >= 0 && segment_ids[k] < download->n_segments &&
+                        peer_list_grant(download->peer_list, header->rank, segment_ids[k])) {
+                        download->order_dirty = 1;
+                    }
+                }
+            }
+        }
+        free(header);
+    }
+}
+
+// Aplică mesajele BITFIELD/HAVE primite de la alți peers; la primul contact
+// pentru un fișier descărcat și local, răspunde cu propriul bitfield
+static void receive_gossip(DownloadEngine* engine) {
+    for (;;) {
+        MPI_Status status;
+        int flag;
+        CHECK_MPI(MPI_Iprobe(MPI_ANY_SOURCE, TAG_GOSSIP, MPI_COMM_WORLD, &flag, &status));
+        if (!flag) {
+            return;
+        }
+
+        int size;
+        int peer = status.MPI_SOURCE;
+        CHECK_MPI(MPI_Get_count(&status, MPI_BYTE, &size));
+        GossipHeader* message = malloc(size);
+        if (!message) {
+            // Mesajul trebuie consumat chiar dacă nu îl putem folosi
+            fprintf(stderr, "Failed to allocate gossip message\n");
+            CHECK_MPI(MPI_Recv(NULL, 0, MPI_BYTE, peer, TAG_GOSSIP, MPI_COMM_WORLD,
+                               MPI_STATUS_IGNORE));
+            continue;
+        }
+        CHECK_MPI(MPI_Recv(message, size, MPI_BYTE, peer, TAG_GOSSIP, MPI_COMM_WORLD,
+                           MPI_STATUS_IGNORE));
+        metric_received(METRIC_GOSSIP, size);
+
+        if (size < (int)sizeof(GossipHeader)) {
+            fprintf(stderr, "Invalid gossip message from %d\n", peer);
+            free(message);
+            continue;
+        }
+
+        // Fișierul poate să nu fie (sau să nu mai fie) descărcat aici
+        FileDownload* download = NULL;
+        for (int i = 0; i < PARALLEL_FILES; i++) {
+            if (engine->file_active[i] && engine->files[i].file_id == message->file_id) {
+                download = &engine->files[i];
+            }
+        }
+        if (!download) {
+            free(message);
+            continue;
+        }
+
+        int n = message->n_segments;
+        if (message->signal == MSG_BITFIELD && n == download->n_segments &&
+                   size == (int)(sizeof(GossipHeader) + BITMAP_WORDS(n) * sizeof(uint64_t))) {
+            // Bitset-ul urmează antetului nealiniat, deci e copiat cuvânt cu cuvânt
+            for (int w = 0; w < BITMAP_WORDS(n); w++) {
+                uint64_t word;
+                memcpy(&word, (char*)(message + 1) + w * sizeof(uint64_t), sizeof(word));
+                while (word) {
+                    if (peer_list_grant(download->peer_list, peer, w * 64 + __builtin_ctzll(word))) {
+                        download->order_dirty = 1;
+                    }
+                    word &= word - 1;
+                }
+            }
+            bitmap_set(download->connected, peer);
+            if (!bitmap_test(download->contacted, peer)) {
+                send_bitfield(engine, download, peer);
+            }
+        } else if (message->signal == MSG_HAVE && n >= 0 &&
+                   size == (int)(sizeof(GossipHeader) + n * sizeof(int))) {
+            const int* segment_ids = (const int*)(message + 1);
+            for (int k = 0; k < n; k++) {
+                if (segment_ids[k] >= 0 && segment_ids[k] < download->n_segments &&
+                    peer_list_grant(download->peer_list, peer, segment_ids[k])) {
+                    download->order_dirty = 1;
+                }
+            }
+        } else {
+            fprintf(stderr, "Invalid gossip message from %d\n", peer);
+        }
+        free(message);
+    }
+}
+
+// Fișier terminat (sau abandonat): anunță tracker-ul și scrie rezultatul
+static void finish_file_download(DownloadEngine* engine, int index) {
+    FileDownload* download = &engine->files[index];
+    int file_id = download->file_id;
+
+    // Notificare tracker despre completare. Trimiterea sincronă garantează că
+    // tracker-ul a procesat tot ce i-a trimis clientul înainte de bariera de
+    // terminare: ultimul mesaj către fiecare shard este un MSG_FINISH
+    TrackerRequest request = {.signal = MSG_FINISH, .file_id = file_id};
+    MPI_Ssend(&request, sizeof(request), MPI_BYTE, tracker_for_file(file_id), 1, MPI_COMM_WORLD);
+    metric_sent(METRIC_FINISH, sizeof(request));
+    metric_observe(HISTOGRAM_FILE_DOWNLOAD, (MPI_Wtime() - download->started_at) * 1e6);
+
+    // Segmentele rămase lipsă (fișier abandonat) apar cu hash-ul nul, apoi
+    // fișierul rezultat este sincronizat și închis de thread-ul de scriere
+    const file_info* owned = &users_files[file_id];
+    for (int seg = 0; download->missing > 0 && seg < download->n_segments; seg++) {
+        if (!bitmap_test(owned->present, seg)) {
+            output_record(download->output_fd, seg, &owned->segments[seg]);
+        }
+    }
+    output_close(download->output_fd);
+
+    // Duplicatele din endgame încă în curs nu mai aparțin niciunui fișier
+    for (int i = 0; i < DOWNLOAD_WINDOW; i++) {
+        if (engine->slots[i].active && engine->slots[i].download == download) {
+            engine->slots[i].download = NULL;
+        }
+    }
+
+    end_file_download(download);
+    engine->file_active[index] = 0;
+    engine->n_files--;
+}
+
+// Pornește fișiere noi din wish_list până la limita de PARALLEL_FILES
+static void admit_files(DownloadEngine* engine, int number_of_files) {
+    for (int i = 0; i < PARALLEL_FILES && engine->next_file < number_of_files; i++) {
+        if (engine->file_active[i]) {
+            continue;
+        }
+
+        const file_info* wanted = &wish_list[engine->next_file++];
+        int file_id = wanted->file_number;
+        if (file_id < 0) {
+            fprintf(stderr, "File %s is not known to the tracker\n", wanted->name);
+            i--;
+            continue;
+        }
+
+        // Orice fișier început se încheie cu MSG_FINISH sau MSG_CANCEL, la care
+        // tracker-ul răspunde cu sfârșitul abonării
+        unsigned int seed = engine->rank * 2654435761u ^ file_id;
+        engine->subscriptions++;
+        if (start_file_download(&engine->files[i], file_id, engine->rank, engine->number_of_tasks,
+                                seed) < 0) {
+            fprintf(stderr, "Failed to get peer list for file %d\n", file_id);
+            TrackerRequest request = {.signal = MSG_CANCEL, .file_id = file_id};
+            MPI_Ssend(&request, sizeof(request), MPI_BYTE, tracker_for_file(file_id), 1,
+                      MPI_COMM_WORLD);
+            metric_sent(METRIC_CANCEL, sizeof(request));
+            i--;  // Slotul rămâne liber pentru următorul fișier
+            continue;
+        }
+        engine->file_active[i] = 1;
+        engine->n_files++;
+    }
+}
+
+// Descarcă fișierele din wish_list, câte PARALLEL_FILES simultan
+static void run_downloads(DownloadEngine* engine, int number_of_files) {
+    int round = 0;
+
+    admit_files(engine, number_of_files);
+
+    while (engine->n_files > 0) {
+        receive_availability(engine, 0);
+        if (engine->gossip) {
+            receive_gossip(engine);
+            complete_gossip(engine);
+        }
+
+        // Umplerea ferestrei, începând de fiecare dată cu alt fișier
+        for (int k = 0; k < PARALLEL_FILES; k++) {
+            int i = (round + k) % PARALLEL_FILES;
+            if (!engine->file_active[i]) {
+                continue;
+            }
+
+            FileDownload* download = &engine->files[i];
+            if (order_due(download)) {
+                order_segments(download, engine->number_of_tasks);
+            }
+
+            // Cu toate segmentele primite, duplicatele rămase nu mai țin fișierul deschis
+            if (fill_window(engine, download) > 0 || (download->n_requests > 0 && download->missing > 0)) {
+                download->stalls = 0;
+                continue;
+            }
+
+            // Peers ocupați cu cererile altor fișiere: se așteaptă răspunsurile lor
+            if (download->missing > 0 && engine->n_active > 0) {
+                continue;
+            }
+
+            // Niciun peer cunoscut nu are segmentele rămase, nici după schimbările
+            // primite de la tracker: cerem o listă nouă
+            if (download->missing > 0 && ++download->stalls <= MAX_REQUEST_ATTEMPTS) {
+                refresh_peer_list(download, engine->number_of_tasks);
+                continue;
+            }
+
+            if (download->missing > 0) {
+                fprintf(stderr, "No available peers for %d segments of file %d\n",
+                        download->missing, download->file_id);
+            }
+            finish_file_download(engine, i);
+        }
+        round++;
+
+        admit_files(engine, number_of_files);
+
+        if (engine->n_active > 0) {
+            int slot_id;
+            CHECK_MPI(MPI_Waitany(DOWNLOAD_WINDOW, engine->replies, &slot_id, MPI_STATUS_IGNORE));
+            if (slot_id != MPI_UNDEFINED) {
+                complete_request(engine, slot_id);
+            }
+        }
+    }
+
+    // Răspunsurile la duplicatele rămase trebuie primite înainte de terminare
+    while (engine->n_active > 0) {
+        int slot_id;
+        CHECK_MPI(MPI_Waitany(DOWNLOAD_WINDOW, engine->replies, &slot_id, MPI_STATUS_IGNORE));
+        complete_request(engine, slot_id);
+    }
+}
+
+// Main download thread function
+void *download_thread_func(void *arg) {
+    Peer_args args = *(Peer_args *)arg;
+    int rank = args.rank;
+    int number_of_files = args.number_of_files;
+    int number_of_tasks = args.number_of_tasks;
+    trace_thread("download");
+
+    DownloadEngine* engine = calloc(1, sizeof(DownloadEngine));
+    if (!engine || !(engine->peer_outstanding = calloc(number_of_tasks, sizeof(int))) ||
+        !(engine->peer_latency = calloc(number_of_tasks, sizeof(double)))) {
+        fprintf(stderr, "Failed to allocate download engine\n");
+        exit(EXIT_FAILURE);
+    }
+    engine->rank = rank;
+    engine->number_of_tasks = number_of_tasks;
+    engine->policy = args.peer_policy;
+    engine->gossip = args.gossip;
+    engine->endgame = args.endgame;
+    engine->next_peer = rank % number_of_tasks;  // Pornire decalată între clienți
+    for (int i = 0; i < DOWNLOAD_WINDOW; i++) {
+        engine->replies[i] = MPI_REQUEST_NULL;
+    }
+
+    // Procesare pentru toate fișierele dorite
+    double started = MPI_Wtime();
+    run_downloads(engine, number_of_files);
+    metric_timeline(engine->first_segment_at ? engine->first_segment_at - started : 0,
+                    MPI_Wtime() - started);
+
+    if (piece_store.dir) {
+        double elapsed = MPI_Wtime() - started;
+        double megabytes = engine->bytes_received / (1024.0 * 1024.0);
+        fprintf(stderr, "Rank %d: downloaded %.2f MB in %.3f s (%.2f MB/s)\n",
+                rank, megabytes, elapsed, elapsed > 0 ? megabytes / elapsed : 0);
+    }
+
+    // Schimbările trimise înaintea sfârșitului abonărilor trebuie consumate
+    while (engine->subscriptions > 0 && !engine->gossip) {
+        receive_availability(engine, 1);
+    }
+
+    // Semnalizare finalizare: după barieră niciun client nu mai cere segmente,
+    // deci thread-ul de upload al acestui rank poate fi oprit. Cu gossip,
+    // mesajele proprii trebuie primite înainte de intrarea în barieră, iar
+    // ale celorlalți sunt consumate până la încheierea ei.
+    MPI_Request barrier = MPI_REQUEST_NULL;
+    int done = 0;
+    while (engine->gossip && !done) {
+        receive_availability(engine, 0);
+        receive_gossip(engine);
+        complete_gossip(engine);
+
+        if (barrier == MPI_REQUEST_NULL && engine->subscriptions == 0 &&
+            engine->n_gossip_sends == 0) {
+            CHECK_MPI(MPI_Ibarrier(termination_comm, &barrier));
+        }
+        if (barrier != MPI_REQUEST_NULL) {
+            CHECK_MPI(MPI_Test(&barrier, &done, MPI_STATUS_IGNORE));
+        }
+        if (!done) {
+            sched_yield();
+        }
+    }
+    if (!engine->gossip) {
+        CHECK_MPI(MPI_Ibarrier(termination_comm, &barrier));
+        CHECK_MPI(MPI_Wait(&barrier, MPI_STATUS_IGNORE));
+    }
+
+    for (int i = 0; i < DOWNLOAD_WINDOW; i++) {
+        free(engine->slots[i].scratch);
+    }
+    free(engine->gossip_sends);
+    free(engine->peer_outstanding);
+    free(engine->peer_latency);
+    free(engine);
+
+    int signal = MSG_TERMINATE;
+    MPI_Send(&signal, 1, MPI_INT, rank, 1, MPI_COMM_WORLD);
+
+    return NULL;
+}
+
+
+
+
+// Serviciul de upload: un dispecer care ține UPLOAD_RECEIVES recepții
+// persistente postate și pune cererile sosite într-o coadă mărginită fără
+// lock-uri, golită de un grup de thread-uri worker.
+typedef struct {
+    int sender;
+    double enqueued_at;
+    SegmentRequestMessage message;
+} UploadJob;
+
+// Coadă MPMC mărginită (algoritmul lui Vyukov): fiecare celulă are un număr
+// de secvență care spune dacă e liberă pentru producător sau plină pentru consumator
+typedef struct {
+    _Atomic size_t sequence;
+    UploadJob job;
+} UploadCell;
+
+typedef struct {
+    UploadCell cells[UPLOAD_QUEUE];
+    _Atomic size_t head;               // Următoarea poziție de scris
+    _Atomic size_t tail;               // Următoarea poziție de citit
+    sem_t items;                       // Workerii dorm cât coada e goală
+} UploadQueue;
+
+static void upload_queue_init(UploadQueue* queue) {
+    for (size_t i = 0; i < UPLOAD_QUEUE; i++) {
+        atomic_store_explicit(&queue->cells[i].sequence, i, memory_order_relaxed);
+    }
+    atomic_store(&queue->head, 0);
+    atomic_store(&queue->tail, 0);
+    sem_init(&queue->items, 0, 0);
+}
+
+static int upload_queue_push(UploadQueue* queue, const UploadJob* job) {
+    size_t pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    for (;;) {
+        UploadCell* cell = &queue->cells[pos & (UPLOAD_QUEUE - 1)];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->head, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                cell->job = *job;
+                atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+                sem_post(&queue->items);
+                return 0;
+            }
+        } else if (diff < 0) {
+            return -1;  // Coadă plină
+        } else {
+            pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+        }
+    }
+}
+
+static void upload_queue_pop(UploadQueue* queue, UploadJob* job) {
+    while (sem_wait(&queue->items) != 0) {
+        // Reluare după întreruperi
+    }
+
+    size_t pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    for (;;) {
+        UploadCell* cell = &queue->cells[pos & (UPLOAD_QUEUE - 1)];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->tail, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                *job = cell->job;
+                atomic_store_explicit(&cell->sequence, pos + UPLOAD_QUEUE, memory_order_release);
+                return;
+            }
+        } else {
+            pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+        }
+    }
+}
+
+static inline size_t upload_queue_depth(UploadQueue* queue) {
+    return atomic_load_explicit(&queue->head, memory_order_relaxed) -
+           atomic_load_explicit(&queue->tail, memory_order_relaxed);
+}
+
+// Configurația serviciului, citită la pornire din TEMA2_UPLOAD_WORKERS și TEMA2_UPLOAD_PIN
+typedef struct {
+    int rank;
+    int workers;
+    int pin;
+} UploadConfig;
+
+typedef struct {
+    UploadQueue* queue;
+    int index;
+    int pin;
+    long served;                       // Cereri servite
+    double service_total;              // Timp total de servire (s)
+    double service_max;
+    double wait_total;                 // Timp total petrecut în coadă (s)
+} UploadWorker;
+
+// Răspunde unei cereri grupate cu un vector de stări, câte una per segment.
+// Cu depozitul de segmente activ, urmează câte un mesaj per segment cerut:
+// conținutul, trimis direct din mapare, sau un mesaj gol pentru refuz.
+void handle_segment_request(int sender_rank, const SegmentRequestMessage *request) {
+    int status[REQUEST_BATCH] = {0};
+    const char* payload[REQUEST_BATCH];
+    int n_segments = request->header.n_segments;
+    int reply_tag = request->header.reply_tag;
+
+    // căutare în indexul de segmente deținute, independent de numărul lor
+    for (int i = 0; i < n_segments; i++) {
+        int file_id, segment_id;
+        payload[i] = NULL;
+        status[i] = segment_index_find(&request->hashes[i], &file_id, &segment_id) ? MSG_ACK : -1;
+
+        if (status[i] == MSG_ACK && piece_store.dir &&
+            !(payload[i] = piece_address(file_id, segment_id))) {
+            status[i] = -1;  // Seed fără conținutul fișierului
+        }
+    }
+
+    // trimite vectorul de stări înapoi, pe tag-ul ales de client pentru cerere
+    MPI_Send(status, n_segments, MPI_INT, sender_rank, reply_tag, MPI_COMM_WORLD);
+    metric_sent(METRIC_SEGMENT_REPLY, n_segments * sizeof(int));
+
+    for (int i = 0; piece_store.dir && i < n_segments; i++) {
+        MPI_Send(payload[i], payload[i] ? piece_store.segment_size : 0, MPI_BYTE, sender_rank,
+                 payload_tag(reply_tag, i), MPI_COMM_WORLD);
+        metric_sent(METRIC_SEGMENT_PAYLOAD, payload[i] ? piece_store.segment_size : 0);
+    }
+}
+
+static void pin_worker(int index) {
+    cpu_set_t allowed, target;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) == 0) {
+        return;
+    }
+
+    // Al index-lea procesor disponibil, circular
+    int skip = index % CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && skip-- == 0) {
+            CPU_ZERO(&target);
+            CPU_SET(cpu, &target);
+            pthread_setaffinity_np(pthread_self(), sizeof(target), &target);
+            return;
+        }
+    }
+}
+
+static void *upload_worker_func(void *arg) {
+    UploadWorker* worker = arg;
+    trace_thread("upload worker");
+    if (worker->pin) {
+        pin_worker(worker->index);
+    }
+
+    for (;;) {
+        UploadJob job;
+        upload_queue_pop(worker->queue, &job);
+        if (job.sender < 0) {
+            break;  // Semnal de oprire de la dispecer
+        }
+
+        double started = MPI_Wtime();
+        double traced = trace_begin();
+        handle_segment_request(job.sender, &job.message);
+        trace_end("upload service", traced, "sender", job.sender);
+        double service = MPI_Wtime() - started;
+
+        worker->served++;
+        worker->service_total += service;
+        worker->wait_total += started - job.enqueued_at;
+        if (service > worker->service_max) {
+            worker->service_max = service;
+        }
+    }
+
+    return NULL;
+}
+
+// Validează un mesaj primit de dispecer; întoarce semnalul sau -1
+static int upload_message_signal(const SegmentRequestMessage* message, int size) {
+    if (size < (int)sizeof(int)) {
+        return -1;
+    }
+    if (message->header.signal != MSG_REQUEST) {
+        return message->header.signal;
+    }
+
+    int n_segments = message->header.n_segments;
+    int reply_tag = message->header.reply_tag;
+    if (n_segments <= 0 || n_segments > REQUEST_BATCH ||
+        reply_tag < TAG_PEER_REPLY || reply_tag >= TAG_PEER_REPLY + DOWNLOAD_WINDOW ||
+        size != (int)(sizeof(SegmentRequestHeader) + n_segments * DIGEST_SIZE)) {
+        return -1;
+    }
+    return MSG_REQUEST;
+}
+
+void *upload_thread_func(void *arg) {
+    UploadConfig config = *(UploadConfig *)arg;
+    int rank = config.rank; // Identificarea rank-ului clientului
+
+    UploadQueue* queue = malloc(sizeof(UploadQueue));
+    UploadWorker* workers = calloc(config.workers, sizeof(UploadWorker));
+    pthread_t* threads = calloc(config.workers, sizeof(pthread_t));
+    if (!queue || !workers || !threads) {
+        fprintf(stderr, "Rank %d: Failed to allocate upload service\n", rank);
+        exit(EXIT_FAILURE);
+    }
+    upload_queue_init(queue);
+
+    for (int i = 0; i < config.workers; i++) {
+        workers[i] = (UploadWorker){.queue = queue, .index = i, .pin = config.pin};
+        if (pthread_create(&threads[i], NULL, upload_worker_func, &workers[i]) != 0) {
+            fprintf(stderr, "Rank %d: Failed to start upload worker %d\n", rank, i);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Recepții persistente, repornite după fiecare mesaj
+    static SegmentRequestMessage buffers[UPLOAD_RECEIVES];
+    MPI_Request receives[UPLOAD_RECEIVES];
+    for (int i = 0; i < UPLOAD_RECEIVES; i++) {
+        CHECK_MPI(MPI_Recv_init(&buffers[i], sizeof(SegmentRequestMessage), MPI_BYTE,
+                                MPI_ANY_SOURCE, 1, MPI_COMM_WORLD, &receives[i]));
+        CHECK_MPI(MPI_Start(&receives[i]));
+    }
+
+    size_t max_depth = 0;
+    double depth_total = 0;
+    long received = 0;
+    int is_running = 1;
+
+    while (is_running) {
+        MPI_Status status;
+        int index, size;
+
+        // Așteptare pentru orice cerere de la alte clienți
+        int mpi_ret = MPI_Waitany(UPLOAD_RECEIVES, receives, &index, &status);
+        if (mpi_ret != MPI_SUCCESS || index == MPI_UNDEFINED) {
+            fprintf(stderr, "Rank %d: Error receiving signal from MPI. Terminating thread.\n", rank);
+            break;
+        }
+
+        int sender_rank = status.MPI_SOURCE;
+        MPI_Get_count(&status, MPI_BYTE, &size);
+        int signal = upload_message_signal(&buffers[index], size);
+
+        switch (signal) {
+            case MSG_REQUEST: {
+                UploadJob job = {.sender = sender_rank, .enqueued_at = MPI_Wtime(),
+                                 .message = buffers[index]};
+
+                // Coada plină: dispecerul cedează procesorul până se eliberează un loc
+                while (upload_queue_push(queue, &job) < 0) {
+                    sched_yield();
+                }
+
+                size_t depth = upload_queue_depth(queue);
+                metric_received(METRIC_SEGMENT_REQUEST, size);
+                metric_observe(HISTOGRAM_UPLOAD_QUEUE_DEPTH, depth);
+                depth_total += depth;
+                received++;
+                if (depth > max_depth) {
+                    max_depth = depth;
+                }
+                break;
+            }
+
+            case MSG_TERMINATE:
+                // Toți clienții au terminat descărcarea, terminăm thread-ul
+                is_running = 0;
+                printf("Rank %d: Termination signal received. Shutting down upload thread.\n", rank);
+                break;
+
+            default:
+                fprintf(stderr, "Rank %d: Unknown signal (%d) received from rank %d. Ignoring.\n", rank, signal, sender_rank);
+                break;
+        }
+
+        if (is_running) {
+            CHECK_MPI(MPI_Start(&receives[index]));
+        }
+    }
+
+    // Anulare recepții rămase și oprirea workerilor
+    for (int i = 0; i < UPLOAD_RECEIVES; i++) {
+        if (receives[i] == MPI_REQUEST_NULL) {
+            continue;
+        }
+        int flag;
+        CHECK_MPI(MPI_Test(&receives[i], &flag, MPI_STATUS_IGNORE));
+        if (!flag) {
+            MPI_Cancel(&receives[i]);
+            MPI_Wait(&receives[i], MPI_STATUS_IGNORE);
+        }
+        MPI_Request_free(&receives[i]);
+    }
+
+    UploadJob stop = {.sender = -1};
+    for (int i = 0; i < config.workers; i++) {
+        while (upload_queue_push(queue, &stop) < 0) {
+            sched_yield();
+        }
+    }
+
+    long served = 0;
+    double service_total = 0, service_max = 0, wait_total = 0;
+    for (int i = 0; i < config.workers; i++) {
+        pthread_join(threads[i], NULL);
+        served += workers[i].served;
+        service_total += workers[i].service_total;
+        wait_total += workers[i].wait_total;
+        if (workers[i].service_max > service_max) {
+            service_max = workers[i].service_max;
+        }
+    }
+
+    if (metrics_path) {
+        fprintf(stderr, "Rank %d: upload served %ld requests with %d workers; "
+                "queue depth avg %.2f max %zu; service avg %.1f us max %.1f us; wait avg %.1f us\n",
+                rank, served, config.workers, received ? depth_total / received : 0.0, max_depth,
+                served ? 1e6 * service_total / served : 0.0, 1e6 * service_max,
+                served ? 1e6 * wait_total / served : 0.0);
+    }
+
+    sem_destroy(&queue->items);
+    free(queue);
+    free(workers);
+    free(threads);
+
+    printf("Rank %d: Upload thread terminated.\n", rank);
+    return NULL;
 }
 
-// receives list from the tracker with all peers/seeds from which
-// the client can request a segment; peer_list contains the hashes
-// of that every client has from the requested file
-
 
-typedef struct PeerListConfig {
-    int number_of_tasks;
-    int file_id;
-    int n_segments;
-} PeerListConfig;
+ 
 
-// Funcție pentru curățarea memoriei alocate
-static void cleanup_peer_list(file_info* peer_list, int count) {
-    if (!peer_list) return;
-    
-    for (int i = 0; i < count; i++) {
-        free(peer_list[i].segments);
+// Conținutul fișierului de intrare inN.txt: fișierele deținute (complete, în
+// ordinea din fișier) și numele din wish list
+typedef struct {
+    file_info* files;
+    int n_files;
+    file_info* wish;
+    int n_wish;
+} Manifest;
+
+static void free_manifest(Manifest* manifest) {
+    for (int i = 0; i < manifest->n_files; i++) {
+        free(manifest->files[i].segments);
+        free(manifest->files[i].present);
+        free(manifest->files[i].advertised);
     }
-    free(peer_list);
+    free(manifest->files);
+    free(manifest->wish);
 }
 
-// Funcție pentru inițializarea listei de peer-uri
-static file_info* init_peer_list(const PeerListConfig* config) {
-    file_info* peer_list = calloc(config->number_of_tasks, sizeof(file_info));
-    if (!peer_list) {
-        fprintf(stderr, "Failed to allocate peer list\n");
-        return NULL;
+// Alocă tabelele unui fișier deținut, cu toate segmentele prezente și anunțate
+static int alloc_owned_file(file_info* file, int n_segments) {
+    file->n_segments = n_segments;
+    file->segments = malloc(n_segments * sizeof(segment_digest));
+    file->present = calloc(BITMAP_WORDS(n_segments), sizeof(uint64_t));
+    file->advertised = calloc(BITMAP_WORDS(n_segments), sizeof(uint64_t));
+    if (!file->segments || !file->present || !file->advertised) {
+        fprintf(stderr, "Failed to allocate memory for segments of file %s\n", file->name);
+        return -1;
     }
 
-    for (int i = 0; i < config->number_of_tasks; i++) {
-        peer_list[i].file_number = config->file_id;
-        peer_list[i].n_segments = config->n_segments;
-        peer_list[i].segments = calloc(config->n_segments, sizeof(char[HASH_SIZE + 1]));
-        
-        if (!peer_list[i].segments) {
-            fprintf(stderr, "Failed to allocate segments for peer %d\n", i);
-            cleanup_peer_list(peer_list, i);
-            return NULL;
-        }
-    }
-    
-    return peer_list;
+    // Fișierele deținute sunt anunțate integral la înregistrare
+    bitmap_fill(file->present, n_segments);
+    bitmap_fill(file->advertised, n_segments);
+    return 0;
 }
 
-// Funcție pentru procesarea unui segment primit
-static int process_segment(file_info* peer_list, const PeerListConfig* config) {
-    int segment_id, peer_id;
-    
-    // Primirea detaliilor segmentului
-    CHECK_MPI(MPI_Recv(&segment_id, 1, MPI_INT, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE));
-    CHECK_MPI(MPI_Recv(&peer_id, 1, MPI_INT, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE));
-    
-    // Validarea indicilor primiți
-    if (segment_id < 0 || segment_id >= config->n_segments ||
-        peer_id < 0 || peer_id >= config->number_of_tasks) {
-        fprintf(stderr, "Invalid indices: segment=%d, peer=%d\n", segment_id, peer_id);
-        return 0;
+// Cititorul inițial, cu fscanf pentru fiecare valoare; păstrat doar ca reper
+// pentru --bench-manifest
+static int read_manifest_stdio(FILE* fp, Manifest* manifest) {
+    int n_files, n_wish;
+    struct stat info;
+    memset(manifest, 0, sizeof(*manifest));
+    if (fstat(fileno(fp), &info) < 0) {
+        return -1;
     }
-    
-    // Primirea hash-ului segmentului
-    CHECK_MPI(MPI_Recv(peer_list[peer_id].segments[segment_id], 
-                      HASH_SIZE + 1, MPI_CHAR, 0, 0, MPI_COMM_WORLD, 
-                      MPI_STATUS_IGNORE));
-    
-    return 1;
-}
 
-// Funcție pentru verificarea datelor primite
-static int validate_received_data(const file_info* peer_list, const PeerListConfig* config) {
-    for (int i = 0; i < config->number_of_tasks; i++) {
-        for (int j = 0; j < config->n_segments; j++) {
-            if (strlen(peer_list[i].segments[j]) > 0) {
-                return 1;
+    // Aceleași limite ca la cititorul mapat, față de dimensiunea fișierului
+    if (fscanf(fp, "%d", &n_files) != 1 || n_files < 0 || n_files > info.st_size / 4 ||
+        !(manifest->files = calloc(n_files + 1, sizeof(file_info)))) {
+        return -1;
+    }
+
+    for (int i = 0; i < n_files; i++) {
+        file_info* file = &manifest->files[manifest->n_files];
+        int n_segments;
+        if (fscanf(fp, "%14s %d", file->name, &n_segments) != 2 || n_segments <= 0) {
+            return -1;
+        }
+        manifest->n_files++;
+        if (alloc_owned_file(file, n_segments) < 0) {
+            return -1;
+        }
+
+        for (int j = 0; j < n_segments; j++) {
+            char hex[HASH_SIZE + 2];
+            if (fscanf(fp, "%33s", hex) != 1 || parse_digest(hex, &file->segments[j]) < 0) {
+                return -1;
             }
         }
     }
+
+    if (fscanf(fp, "%d", &n_wish) != 1 || n_wish < 0 || n_wish > (info.st_size + 1) / 2 ||
+        !(manifest->wish = calloc(n_wish + 1, sizeof(file_info)))) {
+        return -1;
+    }
+    for (int i = 0; i < n_wish; i++) {
+        if (fscanf(fp, "%14s", manifest->wish[i].name) != 1) {
+            return -1;
+        }
+        manifest->wish[i].file_number = -1;
+        manifest->n_wish++;
+    }
     return 0;
 }
 
-// Funcția principală pentru obținerea listei de peer-uri
-file_info* getPeerList(int number_of_tasks, file_info current_file) {
-    // Validare parametri de intrare
-    if (number_of_tasks <= 0 || current_file.n_segments <= 0) {
-        fprintf(stderr, "Invalid parameters: number_of_tasks=%d, segments=%d\n",
-                number_of_tasks, current_file.n_segments);
-        return NULL;
+// Parcurgere într-o singură trecere a fișierului mapat în memorie; fiecare
+// valoare este verificată față de sfârșitul fișierului, iar hash-urile sunt
+// convertite direct în forma binară
+typedef struct {
+    const char* start;
+    const char* cursor;
+    const char* end;
+    const char* path;
+} ManifestScanner;
+
+// Valoarea fiecărei cifre hex, -1 pentru restul caracterelor
+static signed char hex_table[256];
+static int hex_table_ready;
+
+static void init_hex_table(void) {
+    for (int c = 0; c < 256; c++) {
+        hex_table[c] = (signed char)hex_value((char)c);
     }
+    hex_table_ready = 1;
+}
 
-    // Inițializare configurație
-    PeerListConfig config = {
-        .number_of_tasks = number_of_tasks,
-        .file_id = current_file.file_number,
-        .n_segments = current_file.n_segments
-    };
-
-    // Inițializare listă peer-uri
-    file_info* peer_list = init_peer_list(&config);
-    if (!peer_list) return NULL;
+static inline int is_space(char c) {
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
 
-    // Procesare mesaje de la tracker
-    int continue_receiving = 1;
-    while (continue_receiving) {
-        int signal;
-        MPI_Status status;
-        
-        CHECK_MPI(MPI_Recv(&signal, 1, MPI_INT, 0, 0, MPI_COMM_WORLD, &status));
+static void scan_space(ManifestScanner* scanner) {
+    while (scanner->cursor < scanner->end && is_space(*scanner->cursor)) {
+        scanner->cursor++;
+    }
+}
 
-        switch (signal) {
-            case MSG_SEGMENT:
-                if (!process_segment(peer_list, &config)) {
-                    cleanup_peer_list(peer_list, config.number_of_tasks);
-                    return NULL;
-                }
-                break;
+static int scan_error(const ManifestScanner* scanner, const char* what) {
+    fprintf(stderr, "%s: expected %s at offset %ld\n", scanner->path, what,
+            (long)(scanner->cursor - scanner->start));
+    return -1;
+}
 
-            case MSG_END_OF_MESSAGE:
-                continue_receiving = 0;
-                break;
+// Întreg zecimal nenegativ, cel mult INT_MAX
+static int scan_int(ManifestScanner* scanner, int* value) {
+    scan_space(scanner);
+    const char* cursor = scanner->cursor;
+    long long parsed = 0;
 
-            default:
-                fprintf(stderr, "Unknown signal received: %d\n", signal);
-                cleanup_peer_list(peer_list, config.number_of_tasks);
-                return NULL;
+    while (cursor < scanner->end && *cursor >= '0' && *cursor <= '9') {
+        parsed = parsed * 10 + (*cursor++ - '0');
+        if (parsed > INT_MAX) {
+            return scan_error(scanner, "a count that fits in an int");
         }
     }
-
-    // Verificare date valide
-    if (!validate_received_data(peer_list, &config)) {
-        fprintf(stderr, "Warning: No valid segments received\n");
+    if (cursor == scanner->cursor || (cursor < scanner->end && !is_space(*cursor))) {
+        return scan_error(scanner, "a count");
     }
 
-    return peer_list;
+    scanner->cursor = cursor;
+    *value = (int)parsed;
+    return 0;
 }
 
+// Nume de cel mult MAX_FILENAME - 1 caractere
+static int scan_name(ManifestScanner* scanner, char name[MAX_FILENAME]) {
+    scan_space(scanner);
+    const char* cursor = scanner->cursor;
+    while (cursor < scanner->end && !is_space(*cursor)) {
+        cursor++;
+    }
 
-
-// Helper function to update tracker with current segments
-void send_segment_update(int file_id, const file_info *owned_file) {
-    int signal = MSG_UPDATE;
-    MPI_Send(&signal, 1, MPI_INT, 0, 1, MPI_COMM_WORLD);
-    
-    for (int j = 0; j < owned_file->n_segments; j++) {
-        if (strlen(owned_file->segments[j]) > 0) {
-            signal = MSG_SEGMENT;
-            MPI_Send(&signal, 1, MPI_INT, 0, 1, MPI_COMM_WORLD);
-            MPI_Send(&j, 1, MPI_INT, 0, 0, MPI_COMM_WORLD);
-            MPI_Send(&file_id, 1, MPI_INT, 0, 0, MPI_COMM_WORLD);
-            MPI_Send(owned_file->segments[j], HASH_SIZE + 1, MPI_CHAR, 0, 0, MPI_COMM_WORLD);
-        }
+    size_t length = cursor - scanner->cursor;
+    if (length == 0 || length >= MAX_FILENAME) {
+        return scan_error(scanner, "a file name of at most 14 characters");
     }
-    
-    signal = MSG_END_OF_MESSAGE;
-    MPI_Send(&signal, 1, MPI_INT, 0, 1, MPI_COMM_WORLD);
+    memcpy(name, scanner->cursor, length);
+    name[length] = '\0';
+    scanner->cursor = cursor;
+    return 0;
 }
 
-// Helper function to download a segment from a peer
-int download_segment_from_peer(int peer_rank, const char* segment_hash) {
-    int signal = MSG_REQUEST;
-    int max_retries = 3;
-    int retry_count = 0;
-    
-    while (retry_count < max_retries) {
-        MPI_Send(&signal, 1, MPI_INT, peer_rank, 1, MPI_COMM_WORLD);
-        MPI_Send(segment_hash, HASH_SIZE + 1, MPI_CHAR, peer_rank, 1, MPI_COMM_WORLD);
-        
-        MPI_Recv(&signal, 1, MPI_INT, peer_rank, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-        
-        if (signal == MSG_ACK) {
-            return 1; // Success
-        }
-        retry_count++;
+// Exact HASH_SIZE cifre hex, urmate de spațiu sau de sfârșitul fișierului
+static int scan_digest(ManifestScanner* scanner, segment_digest* digest) {
+    scan_space(scanner);
+    const unsigned char* hex = (const unsigned char*)scanner->cursor;
+    if (scanner->end - scanner->cursor < HASH_SIZE ||
+        (scanner->end - scanner->cursor > HASH_SIZE && !is_space(scanner->cursor[HASH_SIZE]))) {
+        return scan_error(scanner, "a 32-digit hash");
     }
-    return 0; // Failed after retries
-}
 
-// Helper function to save downloaded file
-void save_downloaded_file(int rank, int file_id, const file_info *owned_file) {
-    char output_file[MAX_FILENAME];
-    sprintf(output_file, "client%d_file%d", rank, file_id);
-    
-    FILE* new_file = fopen(output_file, "w");
-    if (new_file == NULL) {
-        fprintf(stderr, "Error opening file %s for writing\n", output_file);
-        return;
+    // Cifrele invalide dau -1, deci orice eroare lasă bitul de semn în acumulator
+    int invalid = 0;
+    for (int i = 0; i < DIGEST_SIZE; i++) {
+        int high = hex_table[hex[2 * i]];
+        int low = hex_table[hex[2 * i + 1]];
+        invalid |= high | low;
+        digest->bytes[i] = (uint8_t)(high << 4 | low);
     }
-    
-    for (int k = 0; k < owned_file->n_segments; k++) {
-        fprintf(new_file, "%s\n", owned_file->segments[k]);
+    if (invalid < 0) {
+        return scan_error(scanner, "a 32-digit hash");
     }
-    fclose(new_file);
-}
 
-// Main download thread function
-void *download_thread_func(void *arg) {
-    Peer_args args = *(Peer_args *)arg;
-    int rank = args.rank;
-    int number_of_files = args.number_of_files;
-    int number_of_tasks = args.number_of_tasks;
+    scanner->cursor += HASH_SIZE;
+    return 0;
+}
 
-    // Procesare pentru fiecare fișier dorit
-    for (int file_idx = 0; file_idx < number_of_files; file_idx++) {
-        int signal = MSG_REQUEST;
-        int current_file_id = wish_list[file_idx].file_number;
+static int scan_manifest(ManifestScanner* scanner, Manifest* manifest) {
+    int n_files;
+    if (scan_int(scanner, &n_files) < 0) {
+        return -1;
+    }
 
-        file_info current_file = {.file_number = current_file_id};
+    // Fiecare fișier deținut ocupă cel puțin 4 octeți: separator, nume, spațiu, număr
+    if (n_files < 0 || n_files > (scanner->end - scanner->cursor) / 4) {
+        fprintf(stderr, "%s: invalid file count %d\n", scanner->path, n_files);
+        return -1;
+    }
+    if (!(manifest->files = calloc(n_files + 1, sizeof(file_info)))) {
+        return -1;
+    }
 
-        // Trimitere cerere către tracker
-        MPI_Send(&signal, 1, MPI_INT, 0, 1, MPI_COMM_WORLD);
-        MPI_Send(&current_file_id, 1, MPI_INT, 0, 0, MPI_COMM_WORLD);
+    for (int i = 0; i < n_files; i++) {
+        file_info* file = &manifest->files[i];
+        int n_segments;
+        if (scan_name(scanner, file->name) < 0 || scan_int(scanner, &n_segments) < 0) {
+            return -1;
+        }
 
-        // Obținere informații fișier
-        MPI_Recv(&current_file.n_segments, 1, MPI_INT, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-        users_files[current_file_id].file_number = current_file_id;
-        users_files[current_file_id].n_segments = current_file.n_segments;
+        // Fiecare hash ocupă cel puțin HASH_SIZE + 1 octeți din restul fișierului;
+        // 0 segmente = hash-urile se calculează din depozitul de segmente
+        if (n_segments < 0 || n_segments > (scanner->end - scanner->cursor) / (HASH_SIZE + 1)) {
+            fprintf(stderr, "%s: invalid segment count %d for file %s\n",
+                    scanner->path, n_segments, file->name);
+            return -1;
+        }
 
-        // Obținere lista de peers
-        file_info *peer_list = getPeerList(number_of_tasks, current_file);
-        if (!peer_list) {
-            fprintf(stderr, "Failed to get peer list for file %d\n", current_file_id);
+        manifest->n_files++;
+        if (n_segments == 0) {
             continue;
         }
+        if (alloc_owned_file(file, n_segments) < 0) {
+            return -1;
+        }
+        for (int j = 0; j < n_segments; j++) {
+            if (scan_digest(scanner, &file->segments[j]) < 0) {
+                return -1;
+            }
+        }
+    }
 
-        int segments_processed = 0;
+    int n_wish;
+    if (scan_int(scanner, &n_wish) < 0 || n_wish < 0 ||
+        n_wish > (scanner->end - scanner->cursor + 1) / 2 ||
+        !(manifest->wish = calloc(n_wish + 1, sizeof(file_info)))) {
+        return -1;
+    }
+    for (int i = 0; i < n_wish; i++) {
+        if (scan_name(scanner, manifest->wish[i].name) < 0) {
+            return -1;
+        }
+        manifest->wish[i].file_number = -1;  // Aflat din dicționarul tracker-ului
+        manifest->n_wish++;
+    }
+    return 0;
+}
 
-        // Descărcare segmente
-        for (int seg = 0; seg < current_file.n_segments; seg++) {
-            if (segments_processed == MAX_FILES) {
-                send_segment_update(current_file_id, &users_files[current_file_id]);
+// Citește fișierul de intrare mapat în memorie; -1 dacă nu poate fi citit sau
+// nu respectă formatul
+static int load_manifest(const char* path, Manifest* manifest) {
+    memset(manifest, 0, sizeof(*manifest));
+    if (!hex_table_ready) {
+        init_hex_table();
+    }
 
-                // Obținere listă de peers actualizată
-                for (int i = 0; i < number_of_tasks; i++) {
-                    free(peer_list[i].segments);
-                }
-                free(peer_list);
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) < 0 || info.st_size == 0) {
+        fprintf(stderr, "Eroare la deschiderea fișierului de intrare: %s\n", path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
 
-                signal = MSG_REQUEST;
-                MPI_Send(&signal, 1, MPI_INT, 0, 1, MPI_COMM_WORLD);
-                MPI_Send(&current_file_id, 1, MPI_INT, 0, 0, MPI_COMM_WORLD);
-                MPI_Recv(&current_file.n_segments, 1, MPI_INT, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    char* data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Eroare la maparea fișierului de intrare: %s\n", path);
+        return -1;
+    }
+    madvise(data, info.st_size, MADV_SEQUENTIAL);
 
-                peer_list = getPeerList(number_of_tasks, current_file);
-                segments_processed = 0;
-            }
+    ManifestScanner scanner = {.start = data, .cursor = data, .end = data + info.st_size,
+                               .path = path};
+    int result = scan_manifest(&scanner, manifest);
+    munmap(data, info.st_size);
 
-            if (strlen(users_files[current_file_id].segments[seg]) > 0) {
-                continue; // Segment deja descărcat
-            }
+    if (result < 0) {
+        free_manifest(manifest);
+        memset(manifest, 0, sizeof(*manifest));
+    }
+    return result;
+}
 
-            // Găsire peer optim pentru descărcare
-            int chosen_peer = -1;
+// Funcție auxiliară care adaugă un fișier la mesajul de înregistrare
+static char* pack_file_for_tracker(char* cursor, const file_info* file) {
+    RegisteredFile entry = {.n_segments = file->n_segments};
+    memcpy(entry.name, file->name, MAX_FILENAME);
+    memcpy(cursor, &entry, sizeof(entry));
+    memcpy(cursor + sizeof(entry), file->segments, file->n_segments * sizeof(segment_digest));
+    return cursor + sizeof(entry) + file->n_segments * sizeof(segment_digest);
+}
 
-            for (int p = 1; p < number_of_tasks; p++) {
-                if (p != rank && strlen(peer_list[p].segments[seg]) > 0) {
-                    chosen_peer = p;
-                    break; // Selectăm primul peer disponibil
-                }
+// Funcție principală pentru trimiterea fișierelor deținute către trackere:
+// fiecare shard colectează un singur mesaj cu fișierele care îi revin (posibil niciunul)
+void send_users_files_to_tracker(int n_users_files) {
+    for (int tracker = 0; tracker < n_trackers; tracker++) {
+        int count = 0;
+        size_t size = sizeof(int);
+        for (int i = 0; i < n_users_files; i++) {
+            if (tracker_for_name(users_files[i].name) == tracker) {
+                count++;
+                size += sizeof(RegisteredFile) + users_files[i].n_segments * sizeof(segment_digest);
             }
+        }
 
-            if (chosen_peer == -1) {
-                fprintf(stderr, "No available peers for segment %d of file %d\n", seg, current_file_id);
-                continue;
-            }
+        char* buffer = malloc(size);
+        if (!buffer) {
+            fprintf(stderr, "Failed to allocate registration for tracker %d\n", tracker);
+            exit(EXIT_FAILURE);
+        }
+        memcpy(buffer, &count, sizeof(int));
 
-            // Descărcare segment
-            if (download_segment_from_peer(chosen_peer, peer_list[chosen_peer].segments[seg])) {
-                strcpy(users_files[current_file_id].segments[seg], peer_list[chosen_peer].segments[seg]);
-                segments_processed++;
+        char* cursor = buffer + sizeof(int);
+        for (int i = 0; i < n_users_files; i++) {
+            if (tracker_for_name(users_files[i].name) == tracker) {
+                cursor = pack_file_for_tracker(cursor, &users_files[i]);
             }
         }
 
-        // Notificare tracker despre completare
-        signal = MSG_FINISH;
-        MPI_Send(&signal, 1, MPI_INT, 0, 1, MPI_COMM_WORLD);
-        MPI_Send(&current_file_id, 1, MPI_INT, 0, 0, MPI_COMM_WORLD);
+        gather_registrations(tracker, buffer, size, NULL, NULL);
+        metric_sent(METRIC_REGISTRATION, size);
+        free(buffer);
+    }
+}
 
-        // Salvare fișier și curățare
-        save_downloaded_file(rank, current_file_id, &users_files[current_file_id]);
 
-        for (int i = 0; i < number_of_tasks; i++) {
-            free(peer_list[i].segments);
+// Caută numele în dicționarul primit de la tracker
+static int lookup_file_id(const char* names, int n_files, const char* name) {
+    for (int id = 0; id < n_files; id++) {
+        if (strncmp(names + id * MAX_FILENAME, name, MAX_FILENAME) == 0) {
+            return id;
         }
-        free(peer_list);
     }
-
-    // Semnalizare finalizare
-    int signal = MSG_TERMINATE;
-    MPI_Send(&signal, 1, MPI_INT, 0, 1, MPI_COMM_WORLD);
-
-    return NULL;
+    return -1;
 }
 
+// Reindexează users_files după ID-urile din dicționar și rezolvă wish list-ul;
+// segmentele deținute intră abia acum în indexul după hash
+static void assign_file_ids(const char* names, int n_files, int n_loaded, int n_wish_list) {
+    file_info* files = calloc(n_files > 0 ? n_files : 1, sizeof(file_info));
+    if (!files) {
+        fprintf(stderr, "Failed to allocate memory for users_files\n");
+        exit(EXIT_FAILURE);
+    }
 
+    for (int id = 0; id < n_files; id++) {
+        strncpy(files[id].name, names + id * MAX_FILENAME, MAX_FILENAME - 1);
+        files[id].file_number = id;
+    }
 
+    for (int i = 0; i < n_loaded; i++) {
+        int id = lookup_file_id(names, n_files, users_files[i].name);
+        if (id < 0 || files[id].segments) {
+            fprintf(stderr, "File %s was not registered by the tracker\n", users_files[i].name);
+            free(users_files[i].segments);
+            free(users_files[i].present);
+            free(users_files[i].advertised);
+            continue;
+        }
+        files[id] = users_files[i];
+        files[id].file_number = id;
+    }
 
-void handle_segment_request(int sender_rank, char *requested_hash) {
-    int signal = -1;
-    int found = 0;
+    free(users_files);
+    users_files = files;
+    n_known_files = n_files;
 
-    // caută segmentul în lista de segmente a fiecărui fișier
-    for (int file_id = 1; file_id <= MAX_FILES && !found; file_id++) {
-        if (users_files[file_id].n_segments > 0) {
-            for (int seg = 0; seg < users_files[file_id].n_segments; seg++) {
-                // Check if the requested segment exists
-                if (strcmp(users_files[file_id].segments[seg], requested_hash) == 0) {
-                    signal = MSG_ACK;
-                    found = 1;
-                    break;
-                }
-            }
+    for (int id = 0; id < n_files; id++) {
+        for (int seg = 0; seg < users_files[id].n_segments; seg++) {
+            add_owned_segment(id, seg, &users_files[id].segments[seg]);
         }
     }
 
-    // daca nu a fost gasit segmentul
-    if (!found) {
-        signal = -1;
+    for (int i = 0; i < n_wish_list; i++) {
+        wish_list[i].file_number = lookup_file_id(names, n_files, wish_list[i].name);
     }
-
-    // trimite semnalul înapoi la client
-    MPI_Send(&signal, 1, MPI_INT, sender_rank, 0, MPI_COMM_WORLD);
 }
 
-void *upload_thread_func(void *arg) {
-    int rank = *(int *)arg; // Identificarea rank-ului clientului
-    int is_running = 1;
+// Primește semnalul de start de la un shard: antetul și numele fișierelor sale
+static char* receive_start_signal(int tracker, int* n_files) {
+    int size;
+    char* buffer = broadcast_start_signal(tracker, NULL, &size);
+    metric_received(METRIC_START, size);
 
-    while (is_running) {
-        int signal = -1; // Inițializarea semnalului primit
-        MPI_Status status;
+    StartHeader header = {0};
+    if (size >= (int)sizeof(StartHeader)) {
+        memcpy(&header, buffer, sizeof(header));
+    }
+    if (header.signal != MSG_ACK || header.n_files < 0 ||
+        size != (int)(sizeof(StartHeader) + header.n_files * MAX_FILENAME)) {
+        fprintf(stderr, "Invalid start signal from tracker %d\n", tracker);
+        exit(EXIT_FAILURE);
+    }
 
-        // Așteptare pentru orice cerere de la alte clienți
-        int mpi_ret = MPI_Recv(&signal, 1, MPI_INT, MPI_ANY_SOURCE, 1, MPI_COMM_WORLD, &status);
-        if (mpi_ret != MPI_SUCCESS) {
-            fprintf(stderr, "Rank %d: Error receiving signal from MPI. Terminating thread.\n", rank);
-            break;
+    *n_files = header.n_files;
+    return buffer;
+}
+
+// Așteaptă semnalul de start de la fiecare tracker; dicționarele lor se
+// combină într-unul singur, indexat după ID-ul global
+void wait_for_tracker_confirmation(int n_loaded, int n_wish_list) {
+    char* buffers[n_trackers];
+    int counts[n_trackers];
+    int max_files = 0;
+
+    for (int tracker = 0; tracker < n_trackers; tracker++) {
+        buffers[tracker] = receive_start_signal(tracker, &counts[tracker]);
+        if (counts[tracker] > max_files) {
+            max_files = counts[tracker];
         }
+    }
 
-        int sender_rank = status.MPI_SOURCE;
+    int n_files = max_files * n_trackers;
+    char* names = calloc(n_files > 0 ? n_files : 1, MAX_FILENAME);
+    if (!names) {
+        fprintf(stderr, "Failed to allocate file dictionary\n");
+        exit(EXIT_FAILURE);
+    }
 
-        switch (signal) {
-           case MSG_REQUEST: {
-                char requested_hash[HASH_SIZE + 1] = {0}; // Inițializare buffer pentru hash-ul cerut
+    for (int tracker = 0; tracker < n_trackers; tracker++) {
+        const char* local_names = buffers[tracker] + sizeof(StartHeader);
+        for (int local = 0; local < counts[tracker]; local++) {
+            memcpy(names + (local * n_trackers + tracker) * MAX_FILENAME,
+                   local_names + local * MAX_FILENAME, MAX_FILENAME);
+        }
+        free(buffers[tracker]);
+    }
 
-                // Primirea hash-ului segmentului solicitat
-                mpi_ret = MPI_Recv(requested_hash, HASH_SIZE + 1, MPI_CHAR, sender_rank, 1, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-                if (mpi_ret != MPI_SUCCESS) {
-                    fprintf(stderr, "Rank %d: Error receiving hash from rank %d\n", rank, sender_rank);
-                    continue;
-                }
+    assign_file_ids(names, n_files, n_loaded, n_wish_list);
+    free(names);
+}
 
-                // Procesarea cererii pentru segment
-                handle_segment_request(sender_rank, requested_hash); 
-                break;
-            }
+// Valoare întreagă de cel puțin min dintr-o variabilă de mediu sau valoarea implicită
+static int env_int(const char* name, int fallback, int min) {
+    const char* value = getenv(name);
+    if (!value || !*value) {
+        return fallback;
+    }
 
+    char* end;
+    long parsed = strtol(value, &end, 10);
+    if (*end || parsed < min || parsed > INT_MAX) {
+        fprintf(stderr, "Invalid value %s for %s, using %d\n", value, name, fallback);
+        return fallback;
+    }
+    return parsed;
+}
 
-            case MSG_TERMINATE:
-                // Toți clienții au terminat descărcarea, terminăm thread-ul
-                is_running = 0;
-                printf("Rank %d: Termination signal received. Shutting down upload thread.\n", rank);
-                break;
+static double monotonic_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
 
-            default:
-                fprintf(stderr, "Rank %d: Unknown signal (%d) received from rank %d. Ignoring.\n", rank, signal, sender_rank);
-                break;
+static int manifests_equal(const Manifest* a, const Manifest* b) {
+    if (a->n_files != b->n_files || a->n_wish != b->n_wish) {
+        return 0;
+    }
+    for (int i = 0; i < a->n_files; i++) {
+        if (strcmp(a->files[i].name, b->files[i].name) != 0 ||
+            a->files[i].n_segments != b->files[i].n_segments ||
+            memcmp(a->files[i].segments, b->files[i].segments,
+                   a->files[i].n_segments * sizeof(segment_digest)) != 0) {
+            return 0;
         }
     }
-
-    printf("Rank %d: Upload thread terminated.\n", rank);
-    return NULL;
+    for (int i = 0; i < a->n_wish; i++) {
+        if (strcmp(a->wish[i].name, b->wish[i].name) != 0) {
+            return 0;
+        }
+    }
+    return 1;
 }
 
+// tema2 --bench-manifest <fișier> [repetări]: timpul de citire al unui fișier
+// de intrare cu cititorul fscanf și cu cel mapat, fără MPI
+static int bench_manifest(const char* path, int repeats) {
+    double stdio_time = 0, mapped_time = 0;
+    long long segments = 0;
+
+    for (int r = 0; r < repeats; r++) {
+        Manifest reference, mapped;
+        FILE* fp = fopen(path, "r");
+        if (!fp) {
+            fprintf(stderr, "Eroare la deschiderea fișierului de intrare: %s\n", path);
+            return EXIT_FAILURE;
+        }
 
- 
+        double started = monotonic_seconds();
+        int stdio_result = read_manifest_stdio(fp, &reference);
+        stdio_time += monotonic_seconds() - started;
+        fclose(fp);
 
-void initialize_users_files(int n_users_files, file_info *fp) {
-    // Alocare memorie pentru users_files
-    users_files = malloc((MAX_FILES + 1) * sizeof(file_info));
-    if (!users_files) {
-        fprintf(stderr, "Failed to allocate memory for users_files\n");
-        exit(EXIT_FAILURE);
-    }
+        started = monotonic_seconds();
+        int mapped_result = load_manifest(path, &mapped);
+        mapped_time += monotonic_seconds() - started;
 
-    // Inițializare structură pentru fișierele deținute
-    for (int i = 1; i <= MAX_FILES; i++) {
-        users_files[i].file_number = 0;
-        users_files[i].n_segments = 0;
-        users_files[i].segments = malloc(MAX_CHUNKS * sizeof(char[HASH_SIZE + 1]));
-        if (!users_files[i].segments) {
-            fprintf(stderr, "Failed to allocate memory for segments of file %d\n", i);
-            // Curățare și ieșire în caz de eroare
-            for (int k = 1; k < i; k++) {
-                free(users_files[k].segments);
-            }
-            free(users_files);
-            exit(EXIT_FAILURE);
+        if (stdio_result < 0 || mapped_result < 0 || !manifests_equal(&reference, &mapped)) {
+            fprintf(stderr, "%s: the two parsers disagree\n", path);
+            free_manifest(&reference);
+            free_manifest(&mapped);
+            return EXIT_FAILURE;
         }
 
-        // Inițializare segmente cu șiruri goale
-        for (int j = 0; j < MAX_CHUNKS; j++) {
-            strcpy(users_files[i].segments[j], "");
+        segments = 0;
+        for (int i = 0; i < mapped.n_files; i++) {
+            segments += mapped.files[i].n_segments;
         }
+        free_manifest(&reference);
+        free_manifest(&mapped);
     }
 
-    // Citirea fișierelor deținute din fișierul de intrare
-    for (int i = 0; i < n_users_files; i++) {
-        char filename[MAX_FILENAME];
-        int n_segments;
+    printf("%s: %lld segments, fscanf %.3f ms, mapped %.3f ms, speedup %.1fx\n", path, segments,
+           stdio_time * 1e3 / repeats, mapped_time * 1e3 / repeats,
+           mapped_time > 0 ? stdio_time / mapped_time : 0);
+    return EXIT_SUCCESS;
+}
 
-        // Citire nume fișier și număr de segmente
-        if (fscanf(fp, "%s %d", filename, &n_segments) != 2) {
-            fprintf(stderr, "Failed to read owned file information from input file\n");
-            continue;
+// Construirea manifestului unui fișier real: thread-ul apelant citește loturi
+// de HASH_BATCH segmente în buffere libere, iar HASH_THREADS workeri calculează
+// hash-urile loturilor deja citite, câte MD5_LANES segmente deodată. Citirea
+// următorului lot se suprapune astfel cu calculul celor anterioare.
+typedef struct {
+    int fd;
+    int segment_size;
+    int n_segments;
+    segment_digest* digests;
+
+    int n_slots;
+    uint8_t** buffers;                 // Câte HASH_BATCH segmente per slot
+    int* first_segment;                // Primul segment din fiecare slot
+    int* ready;                        // Coadă circulară de sloturi citite
+    int ready_first, ready_count;
+    int* free_slots;
+    int n_free;
+    int reading;                       // Mai urmează loturi de citit
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+    pthread_cond_t emptied;
+} HashPipeline;
+
+static void hash_batch(HashPipeline* pipeline, const uint8_t* buffer, int first) {
+    int count = pipeline->n_segments - first < HASH_BATCH ? pipeline->n_segments - first : HASH_BATCH;
+    size_t segment_size = pipeline->segment_size;
+
+    int k = 0;
+    for (; k + MD5_LANES <= count; k += MD5_LANES) {
+        const uint8_t* lanes[MD5_LANES];
+        for (int lane = 0; lane < MD5_LANES; lane++) {
+            lanes[lane] = buffer + (k + lane) * segment_size;
         }
+        md5_digest_lanes(lanes, segment_size, &pipeline->digests[first + k]);
+    }
+    for (; k < count; k++) {
+        md5_digest(buffer + k * segment_size, segment_size, &pipeline->digests[first + k]);
+    }
+}
 
-        // Determinare ID fișier din ultimul caracter al numelui
-        int file_id = filename[strlen(filename) - 1] - '0';
-        if (file_id < 1 || file_id > MAX_FILES) {
-            fprintf(stderr, "Invalid file ID %d derived from filename %s\n", file_id, filename);
-            continue;
+static void* hash_worker_func(void* arg) {
+    HashPipeline* pipeline = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&pipeline->lock);
+        while (pipeline->ready_count == 0 && pipeline->reading) {
+            pthread_cond_wait(&pipeline->filled, &pipeline->lock);
+        }
+        if (pipeline->ready_count == 0) {
+            pthread_mutex_unlock(&pipeline->lock);
+            break;
         }
+        int slot = pipeline->ready[pipeline->ready_first];
+        pipeline->ready_first = (pipeline->ready_first + 1) % pipeline->n_slots;
+        pipeline->ready_count--;
+        pthread_mutex_unlock(&pipeline->lock);
 
-        users_files[file_id].file_number = file_id;
-        users_files[file_id].n_segments = n_segments;
+        hash_batch(pipeline, pipeline->buffers[slot], pipeline->first_segment[slot]);
 
-        // Citire hash-uri pentru fiecare segment
-        for (int j = 0; j < n_segments; j++) {
-            if (fscanf(fp, "%s", users_files[file_id].segments[j]) != 1) {
-                fprintf(stderr, "Failed to read segment %d of file %d\n", j, file_id);
-                break;
+        pthread_mutex_lock(&pipeline->lock);
+        pipeline->free_slots[pipeline->n_free++] = slot;
+        pthread_cond_signal(&pipeline->emptied);
+        pthread_mutex_unlock(&pipeline->lock);
+    }
+
+    return NULL;
+}
+
+// Citește loturile în ordine; -1 la o eroare de citire
+static int hash_pipeline_read(HashPipeline* pipeline) {
+    for (int first = 0; first < pipeline->n_segments; first += HASH_BATCH) {
+        pthread_mutex_lock(&pipeline->lock);
+        while (pipeline->n_free == 0) {
+            pthread_cond_wait(&pipeline->emptied, &pipeline->lock);
+        }
+        int slot = pipeline->free_slots[--pipeline->n_free];
+        pthread_mutex_unlock(&pipeline->lock);
+
+        int count = pipeline->n_segments - first < HASH_BATCH ? pipeline->n_segments - first : HASH_BATCH;
+        off_t offset = (off_t)first * pipeline->segment_size;
+        size_t wanted = (size_t)count * pipeline->segment_size;
+        size_t done = 0;
+        while (done < wanted) {
+            ssize_t n = pread(pipeline->fd, pipeline->buffers[slot] + done, wanted - done, offset + done);
+            if (n <= 0) {
+                return -1;
             }
+            done += n;
         }
+
+        pthread_mutex_lock(&pipeline->lock);
+        pipeline->first_segment[slot] = first;
+        pipeline->ready[(pipeline->ready_first + pipeline->ready_count) % pipeline->n_slots] = slot;
+        pipeline->ready_count++;
+        pthread_cond_signal(&pipeline->filled);
+        pthread_mutex_unlock(&pipeline->lock);
     }
+    return 0;
 }
 
+// Completează file (numele este deja setat) cu segmentele fișierului de la
+// path, ca pentru un fișier deținut citit din manifest. Depozitul de segmente
+// transferă doar segmente întregi, deci octeții de după ultimul sunt ignorați.
+static int build_manifest(const char* path, file_info* file, int segment_size, int threads) {
+    HashPipeline pipeline = {.segment_size = segment_size, .reading = 1};
+    struct stat info;
+    pipeline.fd = open(path, O_RDONLY);
+    if (pipeline.fd < 0 || fstat(pipeline.fd, &info) < 0 || info.st_size < segment_size ||
+        info.st_size / segment_size > INT_MAX) {
+        fprintf(stderr, "Cannot hash %s: missing, shorter than a segment or too large\n", path);
+        if (pipeline.fd >= 0) {
+            close(pipeline.fd);
+        }
+        return -1;
+    }
+    pipeline.n_segments = info.st_size / segment_size;
+    if (info.st_size % segment_size) {
+        fprintf(stderr, "%s: ignoring %lld bytes after the last whole segment\n", path,
+                (long long)(info.st_size % segment_size));
+    }
+    posix_fadvise(pipeline.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    if (alloc_owned_file(file, pipeline.n_segments) < 0) {
+        close(pipeline.fd);
+        return -1;
+    }
+    pipeline.digests = file->segments;
+
+    // Două loturi per worker: unul în calcul, unul deja citit
+    pipeline.n_slots = 2 * threads;
+    pipeline.buffers = calloc(pipeline.n_slots, sizeof(uint8_t*));
+    pipeline.first_segment = calloc(pipeline.n_slots, sizeof(int));
+    pipeline.ready = calloc(pipeline.n_slots, sizeof(int));
+    pipeline.free_slots = calloc(pipeline.n_slots, sizeof(int));
+    pthread_t* workers = calloc(threads, sizeof(pthread_t));
+    int ok = pipeline.buffers && pipeline.first_segment && pipeline.ready && pipeline.free_slots && workers;
+    for (int i = 0; ok && i < pipeline.n_slots; i++) {
+        ok = (pipeline.buffers[i] = malloc((size_t)HASH_BATCH * segment_size)) != NULL;
+        pipeline.free_slots[pipeline.n_free++] = i;
+    }
+    pthread_mutex_init(&pipeline.lock, NULL);
+    pthread_cond_init(&pipeline.filled, NULL);
+    pthread_cond_init(&pipeline.emptied, NULL);
+
+    int started = 0;
+    for (; ok && started < threads; started++) {
+        if (pthread_create(&workers[started], NULL, hash_worker_func, &pipeline) != 0) {
+            break;
+        }
+    }
+    int result = ok && started > 0 ? hash_pipeline_read(&pipeline) : -1;
+    if (result < 0) {
+        fprintf(stderr, "Failed to hash %s\n", path);
+    }
+
+    // Workerii termină loturile rămase în coadă, apoi se opresc
+    pthread_mutex_lock(&pipeline.lock);
+    pipeline.reading = 0;
+    pthread_cond_broadcast(&pipeline.filled);
+    pthread_mutex_unlock(&pipeline.lock);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
 
-// Funcție auxiliară pentru a trimite informațiile despre un fișier
-void send_file_to_tracker(const file_info* file) {
-    MPI_Send(&file->file_number, 1, MPI_INT, 0, 0, MPI_COMM_WORLD);
-    MPI_Send(&file->n_segments, 1, MPI_INT, 0, 0, MPI_COMM_WORLD);
-    for (int j = 0; j < file->n_segments; j++) {
-        MPI_Send(file->segments[j], HASH_SIZE + 1, MPI_CHAR, 0, 0, MPI_COMM_WORLD);
+    for (int i = 0; pipeline.buffers && i < pipeline.n_slots; i++) {
+        free(pipeline.buffers[i]);
     }
+    free(pipeline.buffers);
+    free(pipeline.first_segment);
+    free(pipeline.ready);
+    free(pipeline.free_slots);
+    free(workers);
+    pthread_mutex_destroy(&pipeline.lock);
+    pthread_cond_destroy(&pipeline.filled);
+    pthread_cond_destroy(&pipeline.emptied);
+    close(pipeline.fd);
+    return result;
 }
 
-// Funcție principală pentru trimiterea fișierelor deținute către tracker
-void send_users_files_to_tracker(int n_users_files) {
-    MPI_Send(&n_users_files, 1, MPI_INT, 0, 0, MPI_COMM_WORLD);
+static int hash_threads(void) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return env_int("TEMA2_HASH_THREADS", cores > 0 ? cores : 1, 1);
+}
+
+// Fișierele deținute declarate cu 0 segmente în inN.txt sunt citite din
+// depozitul de segmente și hash-urile lor calculate la pornire
+static int hash_owned_files(Manifest* manifest, const char* dir, int segment_size) {
+    for (int i = 0; i < manifest->n_files; i++) {
+        file_info* file = &manifest->files[i];
+        if (file->n_segments > 0) {
+            continue;
+        }
+        if (!dir || !*dir) {
+            fprintf(stderr, "File %s has no hashes and TEMA2_PIECE_DIR is not set\n", file->name);
+            return -1;
+        }
 
-    for (int i = 1; i <= MAX_FILES; i++) {
-        if (users_files[i].n_segments > 0) {
-            send_file_to_tracker(&users_files[i]);
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dir, file->name);
+        if (build_manifest(path, file, segment_size, hash_threads()) < 0) {
+            return -1;
         }
     }
+    return 0;
 }
 
+// tema2 --build-manifest <fișier>...: scrie la stdout secțiunea de fișiere
+// deținute a unui inN.txt, fără MPI; throughput-ul apare la stderr
+static int build_manifest_files(char* paths[], int n_paths) {
+    int segment_size = env_int("TEMA2_SEGMENT_SIZE", SEGMENT_SIZE, 1);
+    int threads = hash_threads();
+    printf("%d\n", n_paths);
+
+    for (int i = 0; i < n_paths; i++) {
+        file_info file = {0};
+        const char* name = strrchr(paths[i], '/') ? strrchr(paths[i], '/') + 1 : paths[i];
+        if (strlen(name) >= MAX_FILENAME) {
+            fprintf(stderr, "File name %s is longer than %d characters\n", name, MAX_FILENAME - 1);
+            return EXIT_FAILURE;
+        }
+        strcpy(file.name, name);
 
-void initialize_wish_list(int n_wish_list, FILE *fp) {
-    wish_list = malloc(sizeof(file_info) * n_wish_list);
+        double started = monotonic_seconds();
+        if (build_manifest(paths[i], &file, segment_size, threads) < 0) {
+            return EXIT_FAILURE;
+        }
+        double elapsed = monotonic_seconds() - started;
 
-    for (int i = 0; i < n_wish_list; i++) {
-        char filename[MAX_FILENAME];
-        fscanf(fp, "%s", filename);
+        printf("%s %d\n", file.name, file.n_segments);
+        for (int j = 0; j < file.n_segments; j++) {
+            char hex[HASH_SIZE + 1];
+            format_digest(&file.segments[j], hex);
+            printf("%s\n", hex);
+        }
 
-        int file_id = filename[strlen(filename) - 1] - '0';
-        wish_list[i].file_number = file_id;
-        wish_list[i].n_segments = 0; // Initialize, segments will be fetched during download
-        wish_list[i].segments = NULL; // To be assigned during download
+        double megabytes = (double)file.n_segments * segment_size / (1024.0 * 1024.0);
+        fprintf(stderr, "%s: %d segments with %d threads in %.3f s (%.1f MB/s)\n", paths[i],
+                file.n_segments, threads, elapsed, elapsed > 0 ? megabytes / elapsed : 0);
+        free(file.segments);
+        free(file.present);
+        free(file.advertised);
     }
-}
-
-void wait_for_tracker_confirmation() {
-    int signal = -1;
-    do {
-        MPI_Recv(&signal, 1, MPI_INT, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-    } while (signal != MSG_ACK);
+    return EXIT_SUCCESS;
 }
 
 void start_threads(int rank, int n_wish_list, int number_of_tasks) {
     pthread_t download_thread, upload_thread;
-    Peer_args args = {.rank = rank, .number_of_files = n_wish_list, .number_of_tasks = number_of_tasks};
+    Peer_args args = {.rank = rank, .number_of_files = n_wish_list, .number_of_tasks = number_of_tasks,
+                      .peer_policy = parse_peer_policy(getenv("TEMA2_PEER_POLICY")),
+                      .gossip = env_int("TEMA2_GOSSIP", 1, 0),
+                      .endgame = env_int("TEMA2_ENDGAME", ENDGAME_THRESHOLD, 0)};
+    UploadConfig upload_config = {.rank = rank,
+                                  .workers = env_int("TEMA2_UPLOAD_WORKERS", UPLOAD_WORKERS, 1),
+                                  .pin = getenv("TEMA2_UPLOAD_PIN") && strcmp(getenv("TEMA2_UPLOAD_PIN"), "0") != 0};
+
+    output_writer_start();
 
     if (pthread_create(&download_thread, NULL, download_thread_func, &args) != 0) {
         fprintf(stderr, "Eroare la crearea thread-ului de download\n");
         exit(EXIT_FAILURE);
     }
 
-    if (pthread_create(&upload_thread, NULL, upload_thread_func, &rank) != 0) {
+    if (pthread_create(&upload_thread, NULL, upload_thread_func, &upload_config) != 0) {
         fprintf(stderr, "Eroare la crearea thread-ului de upload\n");
         exit(EXIT_FAILURE);
     }
@@ -919,6 +4884,7 @@ void start_threads(int rank, int n_wish_list, int number_of_tasks) {
         fprintf(stderr, "Eroare la așteptarea thread-ului de download\n");
         exit(EXIT_FAILURE);
     }
+    output_writer_stop();
 
     if (pthread_join(upload_thread, NULL) != 0) {
         fprintf(stderr, "Eroare la așteptarea thread-ului de upload\n");
@@ -927,10 +4893,14 @@ void start_threads(int rank, int n_wish_list, int number_of_tasks) {
 }
 
 void free_allocated_memory() {
-    for (int i = 1; i <= MAX_FILES; i++) {
+    for (int i = 0; i < n_known_files; i++) {
         free(users_files[i].segments);
+        free(users_files[i].present);
+        free(users_files[i].advertised);
     }
+    piece_store_destroy();
     free(users_files);
+    segment_index_destroy();
     free(wish_list);
 }
 
@@ -938,24 +4908,22 @@ void gestionate_files(int number_of_tasks, int rank) {
     char input_file[MAX_FILENAME];
     sprintf(input_file, "in%d.txt", rank);
 
-    FILE *fp = fopen(input_file, "r");
-    if (!fp) {
-        fprintf(stderr, "Eroare la deschiderea fișierului de intrare: %s\n", input_file);
+    const char* piece_dir = getenv("TEMA2_PIECE_DIR");
+    int segment_size = env_int("TEMA2_SEGMENT_SIZE", SEGMENT_SIZE, 1);
+
+    Manifest manifest;
+    if (load_manifest(input_file, &manifest) < 0 ||
+        hash_owned_files(&manifest, piece_dir, segment_size) < 0) {
         exit(EXIT_FAILURE);
     }
-
-    int n_users_files, n_wish_list;
-    fscanf(fp, "%d", &n_users_files);
-    initialize_users_files(n_users_files, fp);
-
-    send_users_files_to_tracker(n_users_files);
-
-    fscanf(fp, "%d", &n_wish_list);
-    initialize_wish_list(n_wish_list, fp);
-
-    fclose(fp);
-
-    wait_for_tracker_confirmation();
+    users_files = manifest.files;
+    wish_list = manifest.wish;
+    int n_loaded = manifest.n_files;
+    int n_wish_list = manifest.n_wish;
+
+    send_users_files_to_tracker(n_loaded);
+    wait_for_tracker_confirmation(n_loaded, n_wish_list);
+    piece_store_init(piece_dir, segment_size);
     start_threads(rank, n_wish_list, number_of_tasks);
     free_allocated_memory();
 }
@@ -963,6 +4931,13 @@ void gestionate_files(int number_of_tasks, int rank) {
  
 int main (int argc, char *argv[]) {
     int number_of_tasks, rank;
+
+    if (argc >= 3 && strcmp(argv[1], "--bench-manifest") == 0) {
+        return bench_manifest(argv[2], argc >= 4 && atoi(argv[3]) > 0 ? atoi(argv[3]) : 5);
+    }
+    if (argc >= 3 && strcmp(argv[1], "--build-manifest") == 0) {
+        return build_manifest_files(argv + 2, argc - 2);
+    }
  
     int provided;
     MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &provided);
@@ -972,13 +4947,34 @@ int main (int argc, char *argv[]) {
     }
     MPI_Comm_size(MPI_COMM_WORLD, &number_of_tasks);
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_dup(MPI_COMM_WORLD, &termination_comm);
+    metrics_path = getenv("TEMA2_METRICS");
+    if (metrics_path && !*metrics_path) {
+        metrics_path = NULL;
+    }
+    trace_prefix = getenv("TEMA2_TRACE");
+    if (trace_prefix && !*trace_prefix) {
+        trace_prefix = NULL;
+    }
+
+    // Toate rank-urile citesc aceeași valoare, deci împart la fel fișierele
+    n_trackers = env_int("TEMA2_TRACKERS", TRACKER_SHARDS, 1);
+    if (n_trackers >= number_of_tasks) {
+        if (rank == 0) {
+            fprintf(stderr, "Too many trackers (%d) for %d tasks, using 1\n", n_trackers, number_of_tasks);
+        }
+        n_trackers = 1;
+    }
 
-    if (rank == TRACKER_RANK) {
-        tracker(number_of_tasks, rank);
+    if (rank < n_trackers) {
+        tracker(number_of_tasks, rank, env_int("TEMA2_TRACKER_THREADS", TRACKER_THREADS, 0));
     } else {
         gestionate_files(number_of_tasks, rank);
     }
 
+    metrics_report(rank, number_of_tasks);
+    trace_write(rank);
+    MPI_Comm_free(&termination_comm);
     MPI_Finalize();
 
 }
\ No newline at end of file